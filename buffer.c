@@ -2,8 +2,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <limits.h>
+#ifndef EMSYS_DISABLE_MMAP
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 #include "emsys.h"
 #include "buffer.h"
+#include "fileio.h"
 #include "unicode.h"
 #include "undo.h"
 #include "prompt.h"
@@ -13,56 +19,171 @@
 
 extern struct editorConfig E;
 
-void invalidateScreenCache(struct editorBuffer *buf) {
-	buf->screen_line_cache_valid = 0;
-	for (int i = 0; i < buf->numrows; i++) {
-		buf->row[i].width_valid = 0;
+/* row->size is an int and rows keep room for a terminating NUL */
+#define MAX_LINE_LENGTH (INT_MAX - 1)
+
+/*
+ * The screen-line cache is a Fenwick tree over the number of screen
+ * lines each row wraps to, so a row's starting screen line is a prefix
+ * sum and the row on a given screen line is found by descending it.
+ * Editing a row adjusts it in O(log n).  Inserting or deleting rows
+ * shifts every index after them, so the entries from there on are
+ * rebuilt lazily from the cached row widths.
+ */
+static int rowScreenHeight(erow *row) {
+	int cols = E.screencols;
+	return wrappedDisplayColumn(row, row->size, cols) / cols + 1;
+}
+
+static int screenLinePrefix(struct editorBuffer *buf, int rows) {
+	int line = 0;
+	for (int i = rows; i > 0; i -= i & -i)
+		line += buf->screen_line_tree[i];
+	return line;
+}
+
+/* Marks the tree entries for rows from first on as needing a rebuild */
+void invalidateScreenCache(struct editorBuffer *buf, int first) {
+	if (first < 0)
+		first = 0;
+	if (buf->screen_line_cache_rows > first)
+		buf->screen_line_cache_rows = first;
+}
+
+/*
+ * Forgets what is cached about rows first..last after their bytes
+ * changed in place, and moves the screen-line cache along with them.
+ * Operations pass the range they touched; rows outside it keep their
+ * cached widths.
+ */
+void invalidateRows(struct editorBuffer *buf, int first, int last) {
+	if (first < 0)
+		first = 0;
+	if (last >= buf->numrows)
+		last = buf->numrows - 1;
+	int tracked = buf->screen_line_cols == E.screencols ?
+			      buf->screen_line_cache_rows :
+			      0;
+	for (int at = first; at <= last; at++) {
+		erow *row = &buf->row[at];
+		row->width_valid = 0;
+		if (at >= tracked)
+			continue;
+		int delta = rowScreenHeight(row) -
+			    (screenLinePrefix(buf, at + 1) -
+			     screenLinePrefix(buf, at));
+		for (int i = at + 1; delta != 0 && i <= tracked; i += i & -i)
+			buf->screen_line_tree[i] += delta;
+	}
+}
+
+void invalidateRow(struct editorBuffer *buf, erow *row) {
+	int at = row - buf->row;
+	if (at < 0 || at >= buf->numrows) {
+		row->width_valid = 0;
+		buf->screen_line_cache_rows = 0;
+		return;
 	}
+	invalidateRows(buf, at, at);
 }
 
+/*
+ * Brings the tree up to date.  Only entries past the ones still current
+ * are rebuilt: each is first set to its prefix sum in one pass, then
+ * from the top down has the prefix sum before its range taken off.
+ */
 void buildScreenCache(struct editorBuffer *buf) {
-	if (buf->screen_line_cache_valid)
+	if (buf->screen_line_cols != E.screencols)
+		buf->screen_line_cache_rows = 0;
+	int n = buf->numrows;
+	int k = buf->screen_line_cache_rows;
+	if (k >= n)
 		return;
 
-	if (buf->screen_line_cache_size < buf->numrows) {
-		size_t new_size = buf->numrows;
-		if (new_size <= SIZE_MAX - 100) {
+	if (buf->screen_line_cache_size <= n) {
+		size_t new_size = (size_t)n + 1;
+		if (new_size <= INT_MAX - 100) {
 			new_size += 100;
 		}
 		if (new_size > SIZE_MAX / sizeof(int)) {
 			return;
 		}
 		buf->screen_line_cache_size = new_size;
-		buf->screen_line_start =
-			xrealloc(buf->screen_line_start,
+		buf->screen_line_tree =
+			xrealloc(buf->screen_line_tree,
 				 buf->screen_line_cache_size * sizeof(int));
 	}
 
-	if (!buf->screen_line_start)
-		return;
-
-	int screen_line = 0;
-	for (int i = 0; i < buf->numrows; i++) {
-		buf->screen_line_start[i] = screen_line;
-		if (buf->truncate_lines) {
-			screen_line += 1;
-		} else {
-			int width = calculateLineWidth(&buf->row[i]);
-			int lines_used = (width / E.screencols) + 1;
-			screen_line += lines_used;
-		}
+	int *tree = buf->screen_line_tree;
+	int line = screenLinePrefix(buf, k);
+	for (int i = k + 1; i <= n; i++) {
+		line += rowScreenHeight(&buf->row[i - 1]);
+		tree[i] = line;
+	}
+	for (int i = n; i > k; i--) {
+		int before = i - (i & -i);
+		tree[i] -= before > k ? tree[before] :
+					screenLinePrefix(buf, before);
 	}
 
-	buf->screen_line_cache_valid = 1;
+	buf->screen_line_cols = E.screencols;
+	buf->screen_line_cache_rows = n;
 }
 
+/* Screen line on which row starts; row == numrows gives the total */
 int getScreenLineForRow(struct editorBuffer *buf, int row) {
-	if (!buf->screen_line_cache_valid) {
+	if (row > buf->numrows || row < 0)
+		return 0;
+	if (buf->truncate_lines)
+		return row;
+	buildScreenCache(buf);
+	if (buf->screen_line_cache_rows < buf->numrows)
+		return row;
+	return screenLinePrefix(buf, row);
+}
+
+/* First row that starts on or after screen line, or numrows if none */
+int getRowForScreenLine(struct editorBuffer *buf, int line) {
+	int n = buf->numrows;
+	if (line <= 0)
+		return 0;
+	if (!buf->truncate_lines)
 		buildScreenCache(buf);
+	if (buf->truncate_lines || buf->screen_line_cache_rows < n)
+		return line < n ? line : n;
+
+	/* The last row starting before line, found a bit at a time */
+	int row = 0;
+	int step = 1;
+	while (step <= n / 2)
+		step <<= 1;
+	for (; step > 0; step >>= 1) {
+		if (row + step <= n &&
+		    buf->screen_line_tree[row + step] < line) {
+			row += step;
+			line -= buf->screen_line_tree[row];
+		}
 	}
-	if (row >= buf->numrows || row < 0)
-		return 0;
-	return buf->screen_line_start[row];
+	return row < n ? row + 1 : n;
+}
+
+/*
+ * Rows at least COLUMN_MARK_MIN bytes long keep a mark every COLUMN_STEP
+ * columns, built while their width is measured, so finding a column far
+ * along them scans from the nearest mark instead of from the start.
+ */
+#define COLUMN_MARK_MIN 1024
+#define COLUMN_STEP 128
+
+static void addColumnMark(erow *row, int byte, int col) {
+	if (row->nmarks == row->marks_cap) {
+		row->marks_cap = row->marks_cap ? row->marks_cap * 2 : 64;
+		row->marks = xrealloc(row->marks,
+				      row->marks_cap * sizeof(*row->marks));
+	}
+	row->marks[row->nmarks].byte = byte;
+	row->marks[row->nmarks].col = col;
+	row->nmarks++;
 }
 
 int calculateLineWidth(erow *row) {
@@ -70,14 +191,33 @@ int calculateLineWidth(erow *row) {
 		return row->cached_width;
 	}
 
-	if (!row->render_valid) {
-		updateRow(row);
-	}
-
+	int marked = row->size >= COLUMN_MARK_MIN;
+	int next = 0; /* column of the next mark */
 	int screen_x = 0;
+	row->nmarks = 0;
+	row->wrap_cols = -1;
 	for (int i = 0; i < row->size;) {
-		screen_x = nextScreenX(row->chars, &i, screen_x);
-		i++;
+		int run = emsys_printable_run(&row->chars[i], row->size - i);
+		for (; marked && next <= screen_x + run; next += COLUMN_STEP)
+			addColumnMark(row, i + next - screen_x, next);
+		screen_x += run;
+		i += run;
+		if (i < row->size) {
+			int start = i;
+			int x = nextScreenX(row->chars, &i, screen_x);
+			for (; marked && next < x; next += COLUMN_STEP)
+				addColumnMark(row, start, screen_x);
+			/* Tabs stop at the edge unless it is on a tab stop,
+			 * and wider characters may not fit before it */
+			if (row->chars[start] == '\t') {
+				if (row->wrap_cols < 0)
+					row->wrap_cols = -EMSYS_TAB_STOP;
+			} else if (x - screen_x > 1) {
+				row->wrap_cols = 0;
+			}
+			screen_x = x;
+			i++;
+		}
 	}
 
 	row->cached_width = screen_x;
@@ -85,6 +225,22 @@ int calculateLineWidth(erow *row) {
 	return screen_x;
 }
 
+/* Returns the byte offset of a character that starts at or before
+ * column col, setting *x to its column */
+int rowColumnMark(erow *row, int col, int *x) {
+	*x = 0;
+	if (row->size < COLUMN_MARK_MIN || col < COLUMN_STEP)
+		return 0;
+	calculateLineWidth(row);
+	if (row->nmarks == 0)
+		return 0;
+	int k = col / COLUMN_STEP;
+	if (k >= row->nmarks)
+		k = row->nmarks - 1;
+	*x = row->marks[k].col;
+	return row->marks[k].byte;
+}
+
 int charsToDisplayColumn(erow *row, int char_pos) {
 	if (!row || char_pos < 0)
 		return 0;
@@ -93,7 +249,31 @@ int charsToDisplayColumn(erow *row, int char_pos) {
 	}
 
 	int col = 0;
-	for (int i = 0; i < char_pos && i < row->size; i++) {
+	int from = 0;
+	if (char_pos >= COLUMN_MARK_MIN)
+		calculateLineWidth(row);
+	if (char_pos >= COLUMN_MARK_MIN && row->nmarks > 0) {
+		/* Start from the last mark at or before char_pos */
+		int lo = 0;
+		int hi = row->nmarks - 1;
+		while (lo < hi) {
+			int mid = (lo + hi + 1) / 2;
+			if (row->marks[mid].byte <= char_pos)
+				lo = mid;
+			else
+				hi = mid - 1;
+		}
+		from = row->marks[lo].byte;
+		col = row->marks[lo].col;
+	}
+
+	for (int i = from; i < char_pos && i < row->size; i++) {
+		int run = emsys_printable_run(&row->chars[i], char_pos - i);
+		if (run > 0) {
+			col += run;
+			i += run - 1;
+			continue;
+		}
 		if (row->chars[i] == '\t') {
 			col = (col + EMSYS_TAB_STOP) / EMSYS_TAB_STOP *
 			      EMSYS_TAB_STOP;
@@ -109,98 +289,178 @@ int charsToDisplayColumn(erow *row, int char_pos) {
 	return col;
 }
 
-void updateRow(erow *row) {
-	int tabs = 0;
-	int extra = 0;
-	int j;
-	for (j = 0; j < row->size; j++) {
-		if (row->chars[j] == '\t') {
-			tabs++;
-		} else if (ISCTRL(row->chars[j])) {
-			/*
-			 * These need an extra few bytes to display
-			 * CSI 7 m - 4 bytes
-			 * CSI m - 3 bytes
-			 * preceding ^ - 1 byte
-			 */
-			extra += 8;
+/* Columns taken by the character at idx, which is not a tab */
+int charColumns(erow *row, int idx) {
+	uint8_t c = row->chars[idx];
+	if (ISCTRL(c))
+		return 2;
+	if (c < 0x80)
+		return 1;
+	return charInStringWidth(row->chars, idx);
+}
+
+/*
+ * Lays out the character at idx on a row wrapped at cols columns, the
+ * one before it ending at column *x.  Columns count on across screen
+ * lines, line n starting at n * cols.  A tab stops at the end of its
+ * line, and any other character too wide for the rest of the line
+ * starts the next one, leaving the columns it skips empty.  Returns the
+ * column the character starts at and sets *x to the one after it.
+ */
+int wrapCharColumn(erow *row, int idx, int *x, int cols) {
+	int start = *x;
+	int line_end = (start / cols + 1) * cols;
+	if (row->chars[idx] == '\t') {
+		int end = (start + EMSYS_TAB_STOP) / EMSYS_TAB_STOP *
+			  EMSYS_TAB_STOP;
+		*x = end < line_end ? end : line_end;
+		return start;
+	}
+	int width = charColumns(row, idx);
+	if (start + width > line_end && start % cols > 0)
+		start = line_end;
+	*x = start + width;
+	return start;
+}
+
+/*
+ * The column the character at char_pos starts at, laid out by
+ * wrapCharColumn, or the one after the row past its end.  Row heights
+ * come from the end, which is kept until the row or cols changes.
+ */
+int wrappedDisplayColumn(erow *row, int char_pos, int cols) {
+	int width = calculateLineWidth(row);
+	int end = char_pos < row->size ? char_pos : row->size;
+	if (end == row->size && row->wrap_cols == cols)
+		return row->wrap_width;
+	/* Rows that fit on one line, or that lose no columns wrapping,
+	 * have the columns they would have unwrapped */
+	if (width < cols ||
+	    (row->wrap_cols < 0 && cols % -row->wrap_cols == 0))
+		return charsToDisplayColumn(row, end);
+
+	int x = 0;
+	for (int i = 0; i < end;) {
+		int run = emsys_printable_run(&row->chars[i], end - i);
+		x += run;
+		i += run;
+		if (i < end) {
+			wrapCharColumn(row, i, &x, cols);
+			i += utf8_nBytes(row->chars[i]);
 		}
 	}
+	if (end == row->size) {
+		row->wrap_cols = cols;
+		row->wrap_width = x;
+		return x;
+	}
+	/* The character itself may not fit on the line */
+	int next = x;
+	return wrapCharColumn(row, end, &next, cols);
+}
 
-	free(row->render);
-	/* Calculate render buffer size, checking for overflow */
-	size_t render_size = row->size;
-	size_t tab_expansion = tabs * (EMSYS_TAB_STOP - 1);
+/*
+ * Row bytes live in per-buffer slabs: power-of-two slots carved from
+ * 64K chunks, recycled through a free list per size class.  Rows longer
+ * than the largest slot get their own allocation on the large list.
+ * Destroying a buffer frees chunks, not rows.
+ */
+#define ROW_SLAB_MIN 16
+#define ROW_SLAB_MAX (ROW_SLAB_MIN << (ROW_SLAB_CLASSES - 1))
+#define ROW_CHUNK_SIZE (64 * 1024)
 
-	/* Check for overflow in size calculations */
-	if (render_size > SIZE_MAX - tab_expansion - extra - 1) {
-		/* Line too long to render */
-		row->render = xmalloc(1);
-		row->render[0] = '\0';
-		row->renderwidth = 0;
-		return;
+struct editorRowChunk {
+	struct editorRowChunk *next;
+	void *align; /* keep slots 16-byte aligned */
+};
+
+struct editorRowLarge {
+	struct editorRowLarge *prev;
+	struct editorRowLarge *next;
+};
+
+static int slabClass(size_t size) {
+	int class = 0;
+	size_t slot = ROW_SLAB_MIN;
+	while (slot < size) {
+		slot <<= 1;
+		class++;
 	}
+	return class;
+}
 
-	render_size += tab_expansion + extra + 1;
-	row->render = xmalloc(render_size);
-	row->renderwidth = 0;
+static uint8_t *rowAlloc(struct editorRowArena *arena, size_t size,
+			 size_t *capp) {
+	if (size > ROW_SLAB_MAX) {
+		struct editorRowLarge *large = xmalloc(sizeof(*large) + size);
+		large->prev = NULL;
+		large->next = arena->large;
+		if (arena->large)
+			arena->large->prev = large;
+		arena->large = large;
+		*capp = size;
+		return (uint8_t *)(large + 1);
+	}
 
-	int idx = 0;
-	for (j = 0; j < row->size; j++) {
-		/* Ensure we have enough space for worst case (control char = 9 bytes) */
-		if ((size_t)(idx + 10) >= render_size) {
-			break;
-		}
+	int class = slabClass(size);
+	size_t slot = (size_t)ROW_SLAB_MIN << class;
+	*capp = slot;
+	if (arena->free[class] != NULL) {
+		void **chars = arena->free[class];
+		arena->free[class] = *chars;
+		return (uint8_t *)chars;
+	}
+	if (arena->left < slot) {
+		struct editorRowChunk *chunk =
+			xmalloc(sizeof(*chunk) + ROW_CHUNK_SIZE);
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+		arena->bump = (uint8_t *)(chunk + 1);
+		arena->left = ROW_CHUNK_SIZE;
+	}
+	uint8_t *chars = arena->bump;
+	arena->bump += slot;
+	arena->left -= slot;
+	return chars;
+}
 
-		if (row->chars[j] == '\t') {
-			row->renderwidth += EMSYS_TAB_STOP;
-			row->render[idx++] = ' ';
-			while (idx % EMSYS_TAB_STOP != 0 &&
-			       (size_t)idx < render_size - 1)
-				row->render[idx++] = ' ';
-		} else if (row->chars[j] == 0x7f) {
-			row->renderwidth += 2;
-			row->render[idx++] = 0x1b;
-			row->render[idx++] = '[';
-			row->render[idx++] = '7';
-			row->render[idx++] = 'm';
-			row->render[idx++] = '^';
-			row->render[idx++] = '?';
-			row->render[idx++] = 0x1b;
-			row->render[idx++] = '[';
-			row->render[idx++] = 'm';
-		} else if (ISCTRL(row->chars[j])) {
-			row->renderwidth += 2;
-			row->render[idx++] = 0x1b;
-			row->render[idx++] = '[';
-			row->render[idx++] = '7';
-			row->render[idx++] = 'm';
-			row->render[idx++] = '^';
-			row->render[idx++] = row->chars[j] | 0x40;
-			row->render[idx++] = 0x1b;
-			row->render[idx++] = '[';
-			row->render[idx++] = 'm';
-		} else if (row->chars[j] > 0x7f) {
-			int width = charInStringWidth(row->chars, j);
-			row->render[idx++] = row->chars[j];
-			row->renderwidth += width;
-		} else if (utf8_isCont(row->chars[j])) {
-			row->render[idx++] = row->chars[j];
-		} else {
-			row->renderwidth += 1;
-			row->render[idx++] = row->chars[j];
-		}
+static void rowFree(struct editorRowArena *arena, uint8_t *chars,
+		    size_t capacity) {
+	if (capacity > ROW_SLAB_MAX) {
+		struct editorRowLarge *large =
+			(struct editorRowLarge *)chars - 1;
+		if (large->prev)
+			large->prev->next = large->next;
+		else
+			arena->large = large->next;
+		if (large->next)
+			large->next->prev = large->prev;
+		free(large);
+		return;
+	}
+	int class = slabClass(capacity);
+	*(void **)chars = arena->free[class];
+	arena->free[class] = chars;
+}
+
+static void freeRowArena(struct editorRowArena *arena) {
+	while (arena->chunks != NULL) {
+		struct editorRowChunk *next = arena->chunks->next;
+		free(arena->chunks);
+		arena->chunks = next;
+	}
+	while (arena->large != NULL) {
+		struct editorRowLarge *next = arena->large->next;
+		free(arena->large);
+		arena->large = next;
 	}
-	row->render[idx] = 0;
-	row->rsize = idx;
-	row->render_valid = 1;
+	memset(arena, 0, sizeof(*arena));
 }
 
 void editorInsertRow(struct editorBuffer *bufr, int at, char *s, size_t len) {
 	if (at < 0 || at > bufr->numrows)
 		return;
 
-	const size_t MAX_LINE_LENGTH = 1000000;
 	if (len > MAX_LINE_LENGTH) {
 		len = MAX_LINE_LENGTH;
 	}
@@ -219,83 +479,508 @@ void editorInsertRow(struct editorBuffer *bufr, int at, char *s, size_t len) {
 	}
 
 	bufr->row[at].size = len;
-	bufr->row[at].chars = xmalloc(len + 1);
+	bufr->row[at].chars =
+		rowAlloc(&bufr->arena, len + 1, &bufr->row[at].capacity);
 	memcpy(bufr->row[at].chars, s, len);
 	bufr->row[at].chars[len] = '\0';
 
-	bufr->row[at].rsize = 0;
-	bufr->row[at].render = NULL;
 	bufr->row[at].cached_width = 0;
 	bufr->row[at].width_valid = 0;
-	bufr->row[at].render_valid = 0;
+	bufr->row[at].marks = NULL;
+	bufr->row[at].nmarks = 0;
+	bufr->row[at].marks_cap = 0;
+	bufr->row[at].borrowed = 0;
 
 	bufr->numrows++;
 	bufr->dirty = 1;
-	if (at < bufr->numrows - 1 || bufr->screen_line_cache_valid) {
-		invalidateScreenCache(bufr);
+	invalidateScreenCache(bufr, at);
+}
+
+#ifndef EMSYS_DISABLE_MMAP
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/*
+ * Every mapped block of every buffer, so that a SIGBUS can be traced to
+ * the file behind it.  The list only changes outside the handler, and
+ * the handler only runs while row text is being read.
+ */
+static struct editorTextBlock **mapped_blocks;
+static int nmapped;
+static int mapped_cap;
+static long map_pagesize;
+
+static void forgetMappedBlock(struct editorTextBlock *block) {
+	for (int i = 0; i < nmapped; i++) {
+		if (mapped_blocks[i] == block) {
+			mapped_blocks[i] = mapped_blocks[--nmapped];
+			return;
+		}
 	}
 }
 
-void freeRow(erow *row) {
-	free(row->render);
-	free(row->chars);
+/*
+ * Called from the SIGBUS handler.  A fault inside a mapped block means
+ * its file shrank underneath it.  The page is replaced with zeros so the
+ * read that faulted, and any after it, go through, and the block is
+ * marked lost.  Returns 0 if addr is in no mapped block.
+ */
+int editorMappedTextFault(void *addr) {
+	uint8_t *p = addr;
+	for (int i = 0; i < nmapped; i++) {
+		struct editorTextBlock *block = mapped_blocks[i];
+		if (p < block->data || p >= block->data + block->len)
+			continue;
+		uintptr_t page = (uintptr_t)p & ~(uintptr_t)(map_pagesize - 1);
+		if (mmap((void *)page, map_pagesize, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1,
+			 0) == MAP_FAILED)
+			return 0;
+		block->lost = 1;
+		return 1;
+	}
+	return 0;
+}
+#endif
+
+/* Whether rows of buf may still borrow from a file mapping */
+int editorHasMappedText(struct editorBuffer *buf) {
+	for (struct editorTextBlock *block = buf->blocks; block != NULL;
+	     block = block->next) {
+		if (block->mapped)
+			return 1;
+	}
+	return 0;
+}
+
+/* Whether part of a mapping of buf's file has been lost to it shrinking */
+int editorMappedTextLost(struct editorBuffer *buf) {
+	for (struct editorTextBlock *block = buf->blocks; block != NULL;
+	     block = block->next) {
+		if (block->lost)
+			return 1;
+	}
+	return 0;
+}
+
+static void freeTextBlocks(struct editorBuffer *buf) {
+	struct editorTextBlock *block = buf->blocks;
+	while (block != NULL) {
+		struct editorTextBlock *next = block->next;
+#ifndef EMSYS_DISABLE_MMAP
+		if (block->mapped) {
+			forgetMappedBlock(block);
+			munmap(block->data, block->len);
+		} else
+#endif
+			free(block->data);
+		free(block);
+		block = next;
+	}
+	buf->blocks = NULL;
+}
+
+void editorAddTextBlock(struct editorBuffer *bufr, uint8_t *text, size_t len,
+			int mapped) {
+	struct editorTextBlock *block = xmalloc(sizeof(*block));
+	block->data = text;
+	block->len = len;
+	block->mapped = mapped;
+	block->lost = 0;
+	block->next = bufr->blocks;
+	bufr->blocks = block;
+#ifndef EMSYS_DISABLE_MMAP
+	if (mapped) {
+		if (nmapped == mapped_cap) {
+			mapped_cap = mapped_cap ? mapped_cap * 2 : 8;
+			mapped_blocks =
+				xrealloc(mapped_blocks,
+					 mapped_cap * sizeof(*mapped_blocks));
+		}
+		mapped_blocks[nmapped++] = block;
+		if (map_pagesize == 0)
+			map_pagesize = sysconf(_SC_PAGESIZE);
+	}
+#endif
+}
+
+/* Grows the row array so that nlines more rows fit */
+static void reserveRows(struct editorBuffer *bufr, int nlines) {
+	if (bufr->numrows + nlines <= bufr->rowcap)
+		return;
+	int new_cap = bufr->rowcap ? bufr->rowcap : 16;
+	while (new_cap < bufr->numrows + nlines) {
+		if (new_cap > INT_MAX / 2) {
+			new_cap = INT_MAX;
+			break;
+		}
+		new_cap *= 2;
+	}
+	if ((size_t)new_cap > SIZE_MAX / sizeof(erow))
+		die("buffer size overflow");
+	bufr->row = xrealloc(bufr->row, sizeof(erow) * new_cap);
+	memset(&bufr->row[bufr->rowcap], 0,
+	       sizeof(erow) * (new_cap - bufr->rowcap));
+	bufr->rowcap = new_cap;
+}
+
+/*
+ * Inserts the lines of text, which must lie in one of the buffer's
+ * blocks, at row at.  Unless final is set a trailing line without its
+ * newline is left alone, so a block can be split into rows a piece at
+ * a time.  *used is set to the number of bytes consumed.
+ */
+int editorInsertLines(struct editorBuffer *bufr, int at, uint8_t *text,
+		      size_t len, int mapped, int final, size_t *used) {
+	*used = 0;
+	if (at < 0 || at > bufr->numrows)
+		return 0;
+
+	size_t *eol;
+	size_t count = emsys_index_lines(text, len, &eol);
+	if (!final && count > 0 && eol[count - 1] == len)
+		count--;
+	*used = final ? len : count > 0 ? eol[count - 1] + 1 : 0;
+	if (count > (size_t)(INT_MAX - bufr->numrows))
+		die("too many lines");
+	int nlines = count;
+	if (nlines == 0) {
+		free(eol);
+		return 0;
+	}
+
+	reserveRows(bufr, nlines);
+	if (at < bufr->numrows) {
+		memmove(&bufr->row[at + nlines], &bufr->row[at],
+			sizeof(erow) * (bufr->numrows - at));
+	}
+
+	/*
+	 * Rows borrow their chars straight from the block.  A heap block is
+	 * terminated in place where the newline used to be.  A mapped block
+	 * is left untouched so its pages stay clean; those rows end at their
+	 * newline (or CR) byte until rowTerminate overwrites it.
+	 */
+	size_t start = 0;
+	for (int i = 0; i < nlines; i++) {
+		uint8_t *p = text + start;
+		size_t linelen = eol[i] - start;
+		while (linelen > 0 && p[linelen - 1] == '\r')
+			linelen--;
+		if (linelen > MAX_LINE_LENGTH)
+			linelen = MAX_LINE_LENGTH;
+
+		erow *row = &bufr->row[at + i];
+		row->size = linelen;
+		row->cached_width = 0;
+		row->width_valid = 0;
+		row->marks = NULL;
+		row->nmarks = 0;
+		row->marks_cap = 0;
+		if (mapped && eol[i] == len) {
+			/* No newline byte of its own to terminate with */
+			row->chars = rowAlloc(&bufr->arena, linelen + 1,
+					      &row->capacity);
+			memcpy(row->chars, p, linelen);
+			row->chars[linelen] = '\0';
+			row->borrowed = 0;
+		} else {
+			if (!mapped)
+				p[linelen] = '\0';
+			row->chars = p;
+			row->borrowed = 1;
+			row->capacity = 0;
+		}
+		start = eol[i] + 1;
+	}
+	free(eol);
+
+	bufr->numrows += nlines;
+	bufr->dirty = 1;
+	invalidateScreenCache(bufr, at);
+	return nlines;
+}
+
+int editorInsertTextBlock(struct editorBuffer *bufr, int at, uint8_t *text,
+			  size_t len, int mapped) {
+	size_t used;
+	editorAddTextBlock(bufr, text, len, mapped);
+	return editorInsertLines(bufr, at, text, len, mapped, 1, &used);
+}
+
+/* Gives row its own copy of len bytes of text followed by tail */
+static void fillRow(struct editorBuffer *bufr, erow *row, const uint8_t *text,
+		    size_t len, const uint8_t *tail, size_t taillen) {
+	if (len + taillen > MAX_LINE_LENGTH)
+		die("line too long");
+	row->chars = rowAlloc(&bufr->arena, len + taillen + 1, &row->capacity);
+	memcpy(row->chars, text, len);
+	memcpy(row->chars + len, tail, taillen);
+	row->size = len + taillen;
+	row->chars[row->size] = '\0';
+	row->cached_width = 0;
+	row->width_valid = 0;
+	row->marks = NULL;
+	row->nmarks = 0;
+	row->marks_cap = 0;
+	row->borrowed = 0;
+}
+
+/*
+ * Inserts len bytes of text at column x of row y and leaves the cursor
+ * just after them.  The text is split into rows in one pass and the
+ * new rows are spliced into the row array with a single move, so a
+ * large yank or undo costs time in proportion to its size rather than
+ * a row reallocation and cache rebuild per byte.  Nothing is recorded
+ * for undo; callers that need it record the insertion themselves.
+ */
+void bufferInsertText(struct editorBuffer *bufr, int x, int y,
+		      const uint8_t *text, size_t len) {
+	if (y < 0 || y > bufr->numrows)
+		return;
+	if (y == bufr->numrows)
+		editorInsertRow(bufr, bufr->numrows, "", 0);
+	erow *row = &bufr->row[y];
+	if (x < 0 || x > row->size)
+		x = row->size;
+
+	size_t nlines = 0;
+	for (const uint8_t *p = text; (p = memchr(p, '\n', text + len - p));
+	     p++)
+		nlines++;
+	if (nlines > (size_t)(INT_MAX - bufr->numrows))
+		die("too many lines");
+
+	if (nlines == 0) {
+		if (len > (size_t)(MAX_LINE_LENGTH - row->size))
+			die("line too long");
+		rowRealloc(bufr, row, row->size + len + 1);
+		memmove(&row->chars[x + len], &row->chars[x], row->size - x);
+		memcpy(&row->chars[x], text, len);
+		row->size += len;
+		row->chars[row->size] = '\0';
+		invalidateRows(bufr, y, y);
+		bufr->cx = x + len;
+		bufr->cy = y;
+		bufr->dirty = 1;
+		return;
+	}
+
+	reserveRows(bufr, nlines);
+	row = &bufr->row[y];
+	memmove(&bufr->row[y + 1 + nlines], &bufr->row[y + 1],
+		sizeof(erow) * (bufr->numrows - y - 1));
+
+	/* Rows in between take whole lines of text; the last one also
+	 * takes what followed x on row y. */
+	const uint8_t *p = memchr(text, '\n', len);
+	size_t firstlen = p - text;
+	for (size_t i = 1; i <= nlines; i++) {
+		const uint8_t *start = p + 1;
+		const uint8_t *end = memchr(start, '\n', text + len - start);
+		if (end == NULL) {
+			end = text + len;
+			bufr->cx = end - start;
+			fillRow(bufr, &bufr->row[y + i], start, end - start,
+				row->chars + x, row->size - x);
+		} else {
+			fillRow(bufr, &bufr->row[y + i], start, end - start,
+				(const uint8_t *)"", 0);
+		}
+		p = end;
+	}
+
+	if (firstlen > (size_t)(MAX_LINE_LENGTH - x))
+		die("line too long");
+	rowRealloc(bufr, row, x + firstlen + 1);
+	memcpy(&row->chars[x], text, firstlen);
+	row->size = x + firstlen;
+	row->chars[row->size] = '\0';
+	row->width_valid = 0;
+
+	bufr->numrows += nlines;
+	bufr->cy = y + nlines;
+	bufr->dirty = 1;
+	invalidateScreenCache(bufr, y);
+}
+
+/*
+ * Makes room for at least size bytes in row->chars.  Rows grow
+ * geometrically, so typing into a line reallocates only when it has
+ * outgrown its capacity rather than on every keystroke.
+ */
+void rowRealloc(struct editorBuffer *bufr, erow *row, size_t size) {
+	if (!row->borrowed && size <= row->capacity)
+		return;
+	if (size > (size_t)MAX_LINE_LENGTH + 1)
+		die("line too long");
+
+	size_t want = size;
+	if (!row->borrowed && row->capacity <= SIZE_MAX / 2 &&
+	    want < row->capacity * 2)
+		want = row->capacity * 2;
+
+	if (!row->borrowed && row->capacity > ROW_SLAB_MAX) {
+		struct editorRowLarge *large =
+			(struct editorRowLarge *)row->chars - 1;
+		large = xrealloc(large, sizeof(*large) + want);
+		if (large->prev)
+			large->prev->next = large;
+		else
+			bufr->arena.large = large;
+		if (large->next)
+			large->next->prev = large;
+		row->chars = (uint8_t *)(large + 1);
+		row->capacity = want;
+		return;
+	}
+
+	/* Moving to a bigger slot, or out of a borrowed slice for good */
+	size_t cap;
+	uint8_t *chars = rowAlloc(&bufr->arena, want, &cap);
+	size_t keep = row->size;
+	if (keep >= size)
+		keep = size - 1;
+	memcpy(chars, row->chars, keep);
+	chars[keep] = '\0';
+	if (!row->borrowed)
+		rowFree(&bufr->arena, row->chars, row->capacity);
+	row->chars = chars;
+	row->capacity = cap;
+	row->borrowed = 0;
+}
+
+void rowTerminate(erow *row) {
+	row->chars[row->size] = '\0';
+}
+
+/* Gives every row its own copy of its text.  Returns nonzero if some of
+ * it was read from a mapping whose file had shrunk. */
+int editorDetachRows(struct editorBuffer *buf) {
+	for (int i = 0; i < buf->numrows; i++) {
+		erow *row = &buf->row[i];
+		if (row->borrowed)
+			rowRealloc(buf, row, row->size + 1);
+	}
+	int lost = editorMappedTextLost(buf);
+	freeTextBlocks(buf);
+	return lost;
+}
+
+void freeRow(struct editorBuffer *bufr, erow *row) {
+	if (!row->borrowed)
+		rowFree(&bufr->arena, row->chars, row->capacity);
+	free(row->marks);
+}
+
+/* Deletes count rows starting at at, closing the gap in one move */
+void editorDelRows(struct editorBuffer *bufr, int at, int count) {
+	if (at < 0 || at >= bufr->numrows || count <= 0)
+		return;
+	if (count > bufr->numrows - at)
+		count = bufr->numrows - at;
+	for (int i = at; i < at + count; i++)
+		freeRow(bufr, &bufr->row[i]);
+	memmove(&bufr->row[at], &bufr->row[at + count],
+		sizeof(erow) * (bufr->numrows - at - count));
+	bufr->numrows -= count;
+	bufr->dirty = 1;
+	invalidateScreenCache(bufr, at);
 }
 
 void editorDelRow(struct editorBuffer *bufr, int at) {
-	if (at < 0 || at >= bufr->numrows)
+	editorDelRows(bufr, at, 1);
+}
+
+/*
+ * Deletes the text from (startx, starty) up to (endx, endy) and leaves
+ * point where it began.  An end on the row past the last one deletes
+ * to the end of the buffer.
+ */
+void bufferDeleteText(struct editorBuffer *bufr, int startx, int starty,
+		      int endx, int endy) {
+	if (starty < 0 || starty >= bufr->numrows || endy < starty)
 		return;
-	freeRow(&bufr->row[at]);
-	if (at == bufr->numrows - 1) {
-		// Last row, no need to memmove
-		bufr->numrows--;
+	erow *row = &bufr->row[starty];
+	if (startx > row->size)
+		startx = row->size;
+
+	if (starty == endy) {
+		if (endx > row->size)
+			endx = row->size;
+		if (endx < startx)
+			return;
+		rowRealloc(bufr, row, row->size + 1);
+		memmove(&row->chars[startx], &row->chars[endx],
+			row->size - endx);
+		row->size -= endx - startx;
 	} else {
-		memmove(&bufr->row[at], &bufr->row[at + 1],
-			sizeof(erow) * (bufr->numrows - at - 1));
-		bufr->numrows--;
+		const uint8_t *tail = (const uint8_t *)"";
+		int taillen = 0;
+		if (endy < bufr->numrows) {
+			erow *last = &bufr->row[endy];
+			if (endx > last->size)
+				endx = last->size;
+			tail = &last->chars[endx];
+			taillen = last->size - endx;
+		} else {
+			endy = bufr->numrows - 1;
+		}
+		rowRealloc(bufr, row, startx + taillen + 1);
+		memcpy(&row->chars[startx], tail, taillen);
+		row->size = startx + taillen;
+		editorDelRows(bufr, starty + 1, endy - starty);
 	}
+	row->chars[row->size] = '\0';
+
+	bufr->cx = startx;
+	bufr->cy = starty;
 	bufr->dirty = 1;
-	invalidateScreenCache(bufr);
+	invalidateRows(bufr, starty, starty);
 }
 
 void rowInsertChar(struct editorBuffer *bufr, erow *row, int at, int c) {
 	if (at < 0 || at > row->size)
 		at = row->size;
 
-	const size_t MAX_LINE_LENGTH = 1000000;
 	if ((size_t)row->size >= MAX_LINE_LENGTH) {
 		return;
 	}
 
-	row->chars = xrealloc(row->chars, row->size + 2);
+	rowRealloc(bufr, row, row->size + 2);
 	memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
 	row->size++;
 	row->chars[at] = c;
-	row->render_valid = 0;
 	bufr->dirty = 1;
-	row->width_valid = 0;
-	invalidateScreenCache(bufr);
+	invalidateRow(bufr, row);
 }
 
 void editorRowInsertUnicode(struct editorConfig *ed, struct editorBuffer *bufr,
 			    erow *row, int at) {
 	if (at < 0 || at > row->size)
 		at = row->size;
-	row->chars = xrealloc(row->chars, row->size + 1 + ed->nunicode);
+
+	if (row->size > MAX_LINE_LENGTH - ed->nunicode) {
+		return;
+	}
+
+	rowRealloc(bufr, row, row->size + 1 + ed->nunicode);
 	memmove(&row->chars[at + ed->nunicode], &row->chars[at],
 		row->size - at + 1);
 	row->size += ed->nunicode;
 	memcpy(&row->chars[at], ed->unicode, ed->nunicode);
-	row->render_valid = 0;
+	invalidateRow(bufr, row);
 	bufr->dirty = 1;
 }
 
 void rowAppendString(struct editorBuffer *bufr, erow *row, char *s,
 		     size_t len) {
-	row->chars = xrealloc(row->chars, row->size + len + 1);
+	rowRealloc(bufr, row, row->size + len + 1);
 	memcpy(&row->chars[row->size], s, len);
 	row->size += len;
 	row->chars[row->size] = '\0';
-	row->render_valid = 0;
+	invalidateRow(bufr, row);
 	bufr->dirty = 1;
 }
 
@@ -306,7 +991,7 @@ void rowDelChar(struct editorBuffer *bufr, erow *row, int at) {
 	memmove(&row->chars[at], &row->chars[at + size],
 		row->size - ((at + size) - 1));
 	row->size -= size;
-	row->render_valid = 0;
+	invalidateRow(bufr, row);
 	bufr->dirty = 1;
 }
 
@@ -320,12 +1005,28 @@ struct editorBuffer *newBuffer(void) {
 	ret->numrows = 0;
 	ret->rowcap = 0;
 	ret->row = NULL;
+	ret->blocks = NULL;
+	memset(&ret->arena, 0, sizeof(ret->arena));
 	ret->filename = NULL;
+	ret->stamp.known = 0;
 	ret->query = NULL;
 	ret->dirty = 0;
 	ret->special_buffer = 0;
-	ret->undo = newUndo();
+	memset(&ret->undo_pool, 0, sizeof(ret->undo_pool));
+	ret->undo = NULL;
 	ret->redo = NULL;
+	ret->undo_group_seq = -1;
+	ret->undo_group_depth = 0;
+	ret->undo_bytes = 0;
+	ret->undo_budget = EMSYS_UNDO_BUDGET;
+	ret->undo_journal.fd = -1;
+	ret->undo_journal.len = 0;
+	ret->undo_journal.records = 0;
+	ret->undo_seq = 0;
+	memset(&ret->undo_checkpoints, 0, sizeof(ret->undo_checkpoints));
+	ret->undo_checkpoints.fd = -1;
+	ret->undo_checkpoints.gap = EMSYS_UNDO_CHECKPOINT;
+	ret->undo = newUndo(ret);
 	ret->completion_state.last_completed_text = NULL;
 	ret->completion_state.completion_start_pos = 0;
 	ret->completion_state.successive_tabs = 0;
@@ -335,32 +1036,31 @@ struct editorBuffer *newBuffer(void) {
 	ret->truncate_lines = 0;
 	ret->rectangle_mode = 0;
 	ret->single_line = 0;
-	ret->screen_line_start = NULL;
+	ret->screen_line_tree = NULL;
+	ret->screen_line_cols = 0;
 	ret->screen_line_cache_size = 0;
-	ret->screen_line_cache_valid = 0;
+	ret->screen_line_cache_rows = 0;
 	ret->read_only = 0;
+	ret->load = NULL;
 	return ret;
 }
 
 void destroyBuffer(struct editorBuffer *buf) {
+	editorCancelLoad(buf);
 	clearUndosAndRedos(buf);
+	freeUndoPool(buf);
 	free(buf->filename);
 	free(buf->query);
-	free(buf->screen_line_start);
+	free(buf->screen_line_tree);
 	free(buf->completion_state.last_completed_text);
-	for (int i = 0; i < buf->numrows; i++) {
-		freeRow(&buf->row[i]);
-	}
+	for (int i = 0; i < buf->numrows; i++)
+		free(buf->row[i].marks);
 	free(buf->row);
+	freeRowArena(&buf->arena);
+	freeTextBlocks(buf);
 	free(buf);
 }
 
-void editorUpdateBuffer(struct editorBuffer *buf) {
-	for (int i = 0; i < buf->numrows; i++) {
-		buf->row[i].render_valid = 0;
-	}
-}
-
 void editorSwitchToNamedBuffer(struct editorConfig *ed,
 			       struct editorBuffer *current) {
 	char prompt[512];
@@ -1,10 +1,28 @@
 #ifndef EMSYS_BUFFER_H
 #define EMSYS_BUFFER_H
 #include "emsys.h"
-void updateRow(erow *row);
 void editorInsertRow(struct editorBuffer *bufr, int at, char *s, size_t len);
-void freeRow(erow *row);
+void editorAddTextBlock(struct editorBuffer *bufr, uint8_t *text, size_t len,
+			int mapped);
+int editorInsertLines(struct editorBuffer *bufr, int at, uint8_t *text,
+		      size_t len, int mapped, int final, size_t *used);
+int editorInsertTextBlock(struct editorBuffer *bufr, int at, uint8_t *text,
+			  size_t len, int mapped);
+void bufferInsertText(struct editorBuffer *bufr, int x, int y,
+		      const uint8_t *text, size_t len);
+void rowRealloc(struct editorBuffer *bufr, erow *row, size_t size);
+void rowTerminate(erow *row);
+int editorDetachRows(struct editorBuffer *buf);
+int editorHasMappedText(struct editorBuffer *buf);
+int editorMappedTextLost(struct editorBuffer *buf);
+#ifndef EMSYS_DISABLE_MMAP
+int editorMappedTextFault(void *addr);
+#endif
+void freeRow(struct editorBuffer *bufr, erow *row);
+void editorDelRows(struct editorBuffer *bufr, int at, int count);
 void editorDelRow(struct editorBuffer *bufr, int at);
+void bufferDeleteText(struct editorBuffer *bufr, int startx, int starty,
+		      int endx, int endy);
 void rowInsertChar(struct editorBuffer *bufr, erow *row, int at, int c);
 void editorRowInsertUnicode(struct editorConfig *ed, struct editorBuffer *bufr,
 			    erow *row, int at);
@@ -12,15 +30,21 @@ void rowAppendString(struct editorBuffer *bufr, erow *row, char *s, size_t len);
 void rowDelChar(struct editorBuffer *bufr, erow *row, int at);
 struct editorBuffer *newBuffer(void);
 void destroyBuffer(struct editorBuffer *buf);
-void editorUpdateBuffer(struct editorBuffer *buf);
 void editorSwitchToNamedBuffer(struct editorConfig *ed,
 			       struct editorBuffer *current);
 void editorNextBuffer(void);
 void editorPreviousBuffer(void);
 void editorKillBuffer(void);
-void invalidateScreenCache(struct editorBuffer *buf);
+void invalidateScreenCache(struct editorBuffer *buf, int first);
+void invalidateRows(struct editorBuffer *buf, int first, int last);
+void invalidateRow(struct editorBuffer *buf, erow *row);
 void buildScreenCache(struct editorBuffer *buf);
 int getScreenLineForRow(struct editorBuffer *buf, int row);
+int getRowForScreenLine(struct editorBuffer *buf, int line);
 int calculateLineWidth(erow *row);
+int rowColumnMark(erow *row, int col, int *x);
 int charsToDisplayColumn(erow *row, int char_pos);
+int charColumns(erow *row, int idx);
+int wrapCharColumn(erow *row, int idx, int *x, int cols);
+int wrappedDisplayColumn(erow *row, int char_pos, int cols);
 #endif
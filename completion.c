@@ -238,9 +238,7 @@ void getCommandCompletions(struct editorConfig *ed, const char *prefix,
 static void replaceMinibufferText(struct editorBuffer *minibuf,
 				  const char *text) {
 	/* Clear current content */
-	while (minibuf->numrows > 0) {
-		editorDelRow(minibuf, 0);
-	}
+	editorDelRows(minibuf, 0, minibuf->numrows);
 
 	/* Insert new text */
 	editorInsertRow(minibuf, 0, (char *)text, strlen(text));
@@ -266,9 +264,7 @@ static struct editorBuffer *findOrCreateBuffer(const char *name) {
 }
 
 static void clearBuffer(struct editorBuffer *buf) {
-	while (buf->numrows > 0) {
-		editorDelRow(buf, 0);
-	}
+	editorDelRows(buf, 0, buf->numrows);
 }
 
 static void showCompletionsBuffer(char **matches, int n_matches) {
@@ -531,6 +527,7 @@ void editorCompleteWord(struct editorConfig *ed, struct editorBuffer *bufr) {
 		for (int rownum = 0; rownum < scanbuf->numrows; rownum++) {
 			struct erow *scanrow = &scanbuf->row[rownum];
 			regmatch_t pmatch;
+			rowTerminate(scanrow);
 			char *line = (char *)scanrow->chars;
 			char *cursor = line;
 
@@ -0,0 +1,25 @@
+#ifndef _EMSYS_CONFIG_H
+#define _EMSYS_CONFIG_H
+
+/* Make a copy of this file, call it config.h, and change it however you like */
+/* By default, it will be copied as-is by the makefile. */
+
+/* Universal Argument C-u */
+/* #define EMSYS_CU_UARG */
+
+/* CUA mode*/
+/* #define EMSYS_CUA */
+
+/* Bytes of undo history kept in memory per buffer before older
+ * history is moved to a temporary file */
+/* #define EMSYS_UNDO_BUDGET (8 << 20) */
+
+/* Undo payload recorded between two snapshots of a buffer, which let
+ * undo-jump skip over long stretches of history */
+/* #define EMSYS_UNDO_CHECKPOINT (256 << 10) */
+
+/* Wrap each frame in a synchronized update (CSI ?2026) so terminals
+ * that support it never show one half drawn */
+/* #define EMSYS_SYNC_UPDATE */
+
+#endif /* _EMSYS_CONFIG_H */
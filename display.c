@@ -5,6 +5,7 @@
 #include "unused.h"
 #include "region.h"
 #include "buffer.h"
+#include "screen.h"
 #include "util.h"
 #include "wcwidth.h"
 #include <errno.h>
@@ -20,7 +21,6 @@
 #endif
 
 extern struct editorConfig E;
-extern void updateRow(erow *row);
 
 const int minibuffer_height = 1;
 const int statusbar_height = 1;
@@ -42,19 +42,49 @@ void abAppend(struct abuf *ab, const char *s, int len) {
 	ab->len += len;
 }
 
+/* Empties the buffer but keeps its memory for the next use */
+void abReset(struct abuf *ab) {
+	ab->len = 0;
+}
+
 void abFree(struct abuf *ab) {
 	free(ab->b);
 }
 
-/* Check if a render position is within the marked region */
-static int isRenderPosInRegion(struct editorBuffer *buf, int row,
-			       int render_pos) {
+/* Most highlighted spans a row can have: the region and the current match */
+#define MAX_HIGHLIGHTS 4
+
+/* Display columns [start, end) of a row drawn in reverse video */
+struct highlightSpan {
+	int start;
+	int end;
+};
+
+struct rowHighlights {
+	struct highlightSpan span[MAX_HIGHLIGHTS];
+	int n;
+	int next; /* first span not yet passed while drawing */
+};
+
+static void addHighlight(struct rowHighlights *hl, int start, int end) {
+	if (start >= end || hl->n == MAX_HIGHLIGHTS)
+		return;
+	int i = hl->n++;
+	while (i > 0 && hl->span[i - 1].start > start) {
+		hl->span[i] = hl->span[i - 1];
+		i--;
+	}
+	hl->span[i].start = start;
+	hl->span[i].end = end;
+}
+
+/* Adds the part of the marked region on a row, if any */
+static void addRegionHighlight(struct rowHighlights *hl,
+			       struct editorBuffer *buf, int row) {
 	if (markInvalidSilent())
-		return 0;
+		return;
 
 	erow *erow_ptr = &buf->row[row];
-	if (!erow_ptr)
-		return 0;
 
 	if (buf->rectangle_mode) {
 		int top_row = buf->cy < buf->marky ? buf->cy : buf->marky;
@@ -63,12 +93,10 @@ static int isRenderPosInRegion(struct editorBuffer *buf, int row,
 		int right_col = buf->cx > buf->markx ? buf->cx : buf->markx;
 
 		if (row < top_row || row > bottom_row)
-			return 0;
+			return;
 
-		int left_render = charsToDisplayColumn(erow_ptr, left_col);
-		int right_render = charsToDisplayColumn(erow_ptr, right_col);
-
-		return (render_pos >= left_render && render_pos < right_render);
+		addHighlight(hl, charsToDisplayColumn(erow_ptr, left_col),
+			     charsToDisplayColumn(erow_ptr, right_col));
 	} else {
 		int start_row = buf->cy < buf->marky ? buf->cy : buf->marky;
 		int end_row = buf->cy > buf->marky ? buf->cy : buf->marky;
@@ -84,83 +112,87 @@ static int isRenderPosInRegion(struct editorBuffer *buf, int row,
 				buf->markx;
 
 		if (row < start_row || row > end_row)
-			return 0;
-
-		if (row == start_row && row == end_row) {
-			int start_render =
-				charsToDisplayColumn(erow_ptr, start_col);
-			int end_render =
-				charsToDisplayColumn(erow_ptr, end_col);
-			return (render_pos >= start_render &&
-				render_pos < end_render);
-		}
-		if (row == start_row) {
-			int start_render =
-				charsToDisplayColumn(erow_ptr, start_col);
-			return (render_pos >= start_render);
-		}
-		if (row == end_row) {
-			int end_render =
-				charsToDisplayColumn(erow_ptr, end_col);
-			return (render_pos < end_render);
-		}
-		return 1; /* Entire middle row is in region */
+			return;
+
+		/* Rows the region carries on past end to the window edge */
+		int start_render = 0;
+		int end_render = INT_MAX;
+		if (row == start_row)
+			start_render = charsToDisplayColumn(erow_ptr, start_col);
+		if (row == end_row)
+			end_render = charsToDisplayColumn(erow_ptr, end_col);
+		addHighlight(hl, start_render, end_render);
 	}
 }
 
-/* Check if a render position is at the current search match */
-static int isRenderPosCurrentSearchMatch(struct editorBuffer *buf, int row,
-					 int render_pos) {
+/* Adds the current search match, if it is on this row */
+static void addMatchHighlight(struct rowHighlights *hl,
+			      struct editorBuffer *buf, int row) {
 	if (!buf->query || !buf->query[0] || !buf->match)
-		return 0;
+		return;
 	if (row != buf->cy)
-		return 0;
+		return;
 
 	erow *erow_ptr = &buf->row[row];
-	if (!erow_ptr)
-		return 0;
-
 	int match_len = strlen((char *)buf->query);
-	int start_render = charsToDisplayColumn(erow_ptr, buf->cx);
-	int end_render = charsToDisplayColumn(erow_ptr, buf->cx + match_len);
+	addHighlight(hl, charsToDisplayColumn(erow_ptr, buf->cx),
+		     charsToDisplayColumn(erow_ptr, buf->cx + match_len));
+}
 
-	return (render_pos >= start_render && render_pos < end_render);
+/* Works out once per row which display columns are highlighted */
+static void rowHighlights(struct rowHighlights *hl, struct editorBuffer *buf,
+			  int row) {
+	hl->n = 0;
+	hl->next = 0;
+	addRegionHighlight(hl, buf, row);
+	addMatchHighlight(hl, buf, row);
+}
+
+/* Whether column x is highlighted.  Columns must be asked about in
+ * increasing order, so the spans are walked only once per row. */
+static int highlightAt(struct rowHighlights *hl, int x) {
+	while (hl->next < hl->n && hl->span[hl->next].end <= x)
+		hl->next++;
+	for (int i = hl->next; i < hl->n && hl->span[i].start <= x; i++) {
+		if (x < hl->span[i].end)
+			return 1;
+	}
+	return 0;
+}
+
+/* Switches reverse video on or off to match highlight */
+static void setHighlight(struct abuf *ab, int *current, int highlight) {
+	if (highlight == *current)
+		return;
+	if (*current)
+		abAppend(ab, "\x1b[0m", 4);
+	if (highlight)
+		abAppend(ab, "\x1b[7m", 4); /* Reverse video */
+	*current = highlight;
 }
 
 /* Calculate number of rows to scroll for smooth scrolling */
 int calculateRowsToScroll(struct editorBuffer *buf, struct editorWindow *win,
 			  int direction) {
-	int rendered_lines = 0;
-	int rows_to_scroll = 0;
-	int start_row = (direction > 0) ? win->rowoff : win->rowoff - 1;
-
-	while (rendered_lines < win->height) {
-		if (start_row < 0 || start_row >= buf->numrows)
-			break;
-		erow *row = &buf->row[start_row];
-		int line_height =
-			buf->truncate_lines ?
-				1 :
-				((calculateLineWidth(row) / E.screencols) + 1);
-		if (rendered_lines + line_height > win->height && direction < 0)
-			break;
-		rendered_lines += line_height;
-		rows_to_scroll++;
-		start_row += direction;
-	}
-
-	return rows_to_scroll;
+	int top = getScreenLineForRow(buf, win->rowoff);
+	if (direction > 0)
+		return getRowForScreenLine(buf, top + win->height) -
+		       win->rowoff;
+	return win->rowoff - getRowForScreenLine(buf, top - win->height);
 }
 
 /* Render a line with highlighting support */
 static void renderLineWithHighlighting(erow *row, struct abuf *ab,
 				       int start_col, int end_col,
 				       struct editorBuffer *buf, int filerow) {
-	int render_x = 0;
-	int char_idx = 0;
+	int render_x;
+	int char_idx = rowColumnMark(row, start_col, &render_x);
 	int current_highlight = 0;
+	struct rowHighlights hl;
+
+	rowHighlights(&hl, buf, filerow);
 
-	/* Skip to start column */
+	/* Skip to start column from the nearest mark before it */
 	while (char_idx < row->size && render_x < start_col) {
 		if (row->chars[char_idx] < 0x80 &&
 		    !ISCTRL(row->chars[char_idx])) {
@@ -176,20 +208,13 @@ static void renderLineWithHighlighting(erow *row, struct abuf *ab,
 	while (char_idx < row->size && render_x < end_col) {
 		uint8_t c = row->chars[char_idx];
 
-		int in_region = isRenderPosInRegion(buf, filerow, render_x);
-		int is_current_match =
-			isRenderPosCurrentSearchMatch(buf, filerow, render_x);
-		int new_highlight = (in_region || is_current_match) ? 1 : 0;
+		/* Nothing is drawn past the edge, where the terminal would
+		 * wrap it on to the next line */
+		if (c != '\t' &&
+		    render_x + charColumns(row, char_idx) > end_col)
+			break;
 
-		if (new_highlight != current_highlight) {
-			if (current_highlight > 0) {
-				abAppend(ab, "\x1b[0m", 4);
-			}
-			if (new_highlight == 1) {
-				abAppend(ab, "\x1b[7m", 4); /* Reverse video */
-			}
-			current_highlight = new_highlight;
-		}
+		setHighlight(ab, &current_highlight, highlightAt(&hl, render_x));
 
 		if (c == '\t') {
 			int next_tab_stop = (render_x + EMSYS_TAB_STOP) /
@@ -296,6 +321,54 @@ void editorSwitchWindow(void) {
 }
 
 /* Display functions */
+/*
+ * Screen lines of the first row shown that are scrolled off the top.
+ * Only a cursor row taller than the whole window is shown from partway
+ * through, far enough down that the cursor sits on the last line.
+ */
+static int rowLinesSkipped(struct editorWindow *win) {
+	struct editorBuffer *buf = win->buf;
+	int cy = win->focused ? buf->cy : win->cy;
+	int cx = win->focused ? buf->cx : win->cx;
+	if (buf->truncate_lines || cy != win->rowoff || cy >= buf->numrows)
+		return 0;
+	erow *row = &buf->row[cy];
+	int cols = E.screencols;
+	if (wrappedDisplayColumn(row, row->size, cols) / cols + 1 <=
+	    win->height)
+		return 0;
+	int line = wrappedDisplayColumn(row, cx, cols) / cols;
+	return line >= win->height ? line - win->height + 1 : 0;
+}
+
+/* Steps over screen lines of a wrapped row the same way drawRows lays
+ * them out. */
+static void skipScreenLines(erow *row, int lines, int screencols,
+			    int *char_idx, int *render_x) {
+	int idx = 0;
+	int rx = 0;
+	int stop = lines * screencols;
+	while (idx < row->size && rx < stop) {
+		int room = stop - rx;
+		int run = emsys_printable_run(&row->chars[idx],
+					      row->size - idx < room ?
+						      row->size - idx :
+						      room);
+		if (run > 0) {
+			rx += run;
+			idx += run;
+			continue;
+		}
+		int x = rx;
+		if (wrapCharColumn(row, idx, &x, screencols) >= stop)
+			break;
+		rx = x;
+		idx += utf8_nBytes(row->chars[idx]);
+	}
+	*char_idx = idx;
+	*render_x = rx > stop ? rx : stop;
+}
+
 void setScxScy(struct editorWindow *win) {
 	struct editorBuffer *buf = win->buf;
 	erow *row = (buf->cy >= buf->numrows) ? NULL : &buf->row[buf->cy];
@@ -307,14 +380,8 @@ void setScxScy(struct editorWindow *win) {
 		if (buf->cy >= buf->numrows) {
 			// For virtual line, calculate position as if there's a line at buf->numrows
 			if (buf->numrows > 0) {
-				int virtual_screen_line = getScreenLineForRow(
-					buf, buf->numrows - 1);
-				// Add one line for the virtual line position
-				virtual_screen_line +=
-					((calculateLineWidth(
-						  &buf->row[buf->numrows - 1]) /
-					  E.screencols) +
-					 1);
+				int virtual_screen_line =
+					getScreenLineForRow(buf, buf->numrows);
 				int rowoff_screen_line =
 					getScreenLineForRow(buf, win->rowoff);
 				win->scy = virtual_screen_line -
@@ -338,14 +405,13 @@ void setScxScy(struct editorWindow *win) {
 		return;
 	}
 
-	int total_width = charsToDisplayColumn(row, buf->cx);
-
 	if (buf->truncate_lines) {
-		win->scx = total_width - win->coloff;
+		win->scx = charsToDisplayColumn(row, buf->cx) - win->coloff;
 	} else {
-		int render_pos = charsToDisplayColumn(row, buf->cx);
-		win->scy += render_pos / E.screencols;
-		win->scx = render_pos % E.screencols;
+		int total_width =
+			wrappedDisplayColumn(row, buf->cx, E.screencols);
+		win->scy += total_width / E.screencols - rowLinesSkipped(win);
+		win->scx = total_width % E.screencols;
 	}
 
 	if (win->scy < 0)
@@ -373,61 +439,29 @@ void scroll(void) {
 		if (buf->cy < win->rowoff) {
 			win->rowoff = buf->cy;
 		} else {
-			int cursor_screen_row = 0;
-
-			for (int i = win->rowoff;
-			     i < buf->cy && i < buf->numrows; i++) {
-				int line_height =
-					(calculateLineWidth(&buf->row[i]) /
-					 E.screencols) +
-					1;
-				cursor_screen_row += line_height;
-			}
+			int cursor_screen_row =
+				getScreenLineForRow(buf, buf->cy) -
+				getScreenLineForRow(buf, win->rowoff);
 
 			if (buf->cy < buf->numrows) {
-				erow *row = &buf->row[buf->cy];
-				int cursor_x = 0;
-				for (int j = 0; j < buf->cx;) {
-					int char_width;
-					if (j < row->size &&
-					    row->chars[j] == '\t') {
-						char_width = EMSYS_TAB_STOP -
-							     (cursor_x %
-							      EMSYS_TAB_STOP);
-					} else {
-						char_width = charInStringWidth(
-							row->chars, j);
-					}
-					cursor_x += char_width;
-					j += utf8_nBytes(row->chars[j]);
-				}
+				int cursor_x = wrappedDisplayColumn(
+					&buf->row[buf->cy], buf->cx,
+					E.screencols);
 				cursor_screen_row += cursor_x / E.screencols;
 			}
 
 			if (cursor_screen_row >= win->height) {
-				int visible_rows = 0;
-				if (buf->cy == buf->numrows) {
-					visible_rows = 1;
-				}
-				for (int i = buf->cy; i >= 0; i--) {
-					if (i < buf->numrows) {
-						int line_height =
-							(calculateLineWidth(
-								 &buf->row[i]) /
-							 E.screencols) +
-							1;
-						if (visible_rows + line_height >
-						    win->height) {
-							win->rowoff = i + 1;
-							break;
-						}
-						visible_rows += line_height;
-					}
-					if (i == 0) {
-						win->rowoff = 0;
-						break;
-					}
-				}
+				/* Start the window as far up as still shows
+				 * the whole cursor row */
+				int end = getScreenLineForRow(buf, buf->cy) + 1;
+				if (buf->cy < buf->numrows)
+					end = getScreenLineForRow(buf,
+								  buf->cy + 1);
+				win->rowoff = getRowForScreenLine(
+					buf, end - win->height);
+				/* A cursor row taller than the window starts it */
+				if (win->rowoff > buf->cy)
+					win->rowoff = buf->cy;
 			}
 		}
 	} else {
@@ -440,25 +474,8 @@ void scroll(void) {
 
 	if (buf->truncate_lines) {
 		int rx = 0;
-		if (buf->cy < buf->numrows) {
-			erow *row = &buf->row[buf->cy];
-			for (int j = 0; j < buf->cx;) {
-				if (j < row->size) {
-					if (row->chars[j] == '\t') {
-						rx += EMSYS_TAB_STOP -
-						      (rx % EMSYS_TAB_STOP);
-					} else {
-						int char_width =
-							charInStringWidth(
-								row->chars, j);
-						rx += char_width;
-					}
-					j += utf8_nBytes(row->chars[j]);
-				} else {
-					break;
-				}
-			}
-		}
+		if (buf->cy < buf->numrows)
+			rx = charsToDisplayColumn(&buf->row[buf->cy], buf->cx);
 		if (rx < win->coloff) {
 			win->coloff = rx;
 		} else if (rx >= win->coloff + E.screencols) {
@@ -482,9 +499,6 @@ void drawRows(struct editorWindow *win, struct abuf *ab, int screenrows,
 			abAppend(ab, CSI "34m~" CSI "0m", 10);
 		} else {
 			erow *row = &buf->row[filerow];
-			if (!row->render_valid) {
-				updateRow(row);
-			}
 			if (buf->truncate_lines) {
 				// Truncated mode with visual marking
 				renderLineWithHighlighting(
@@ -497,102 +511,59 @@ void drawRows(struct editorWindow *win, struct abuf *ab, int screenrows,
 				int char_idx = 0;
 				int current_highlight = 0;
 				int line_start_render_x = 0;
+				/* The screen line the row's end is on */
+				int last_line = wrappedDisplayColumn(
+							row, row->size,
+							screencols) /
+						screencols;
+				struct rowHighlights hl;
+
+				rowHighlights(&hl, buf, filerow);
+
+				if (filerow == win->rowoff)
+					skipScreenLines(row,
+							rowLinesSkipped(win),
+							screencols, &char_idx,
+							&render_x);
 
 				while (char_idx < row->size && y < screenrows) {
 					// Track start of current screen line
 					line_start_render_x = render_x;
+					int line_end = line_start_render_x +
+						       screencols;
 
 					// Render one screen line worth of content
 					while (char_idx < row->size &&
-					       render_x - line_start_render_x <
-						       screencols) {
+					       render_x < line_end) {
 						uint8_t c =
 							row->chars[char_idx];
 
-						int in_region =
-							isRenderPosInRegion(
-								buf, filerow,
-								render_x);
-						int is_current_match =
-							isRenderPosCurrentSearchMatch(
-								buf, filerow,
-								render_x);
-						int new_highlight =
-							(in_region ||
-							 is_current_match) ?
-								1 :
-								0;
-
-						if (new_highlight !=
-						    current_highlight) {
-							if (current_highlight >
-							    0) {
-								abAppend(
-									ab,
-									"\x1b[0m",
-									4);
-							}
-							if (new_highlight ==
-							    1) {
-								abAppend(
-									ab,
-									"\x1b[7m",
-									4); /* Reverse video */
-							}
-							current_highlight =
-								new_highlight;
-						}
+						/* A character that would run
+						 * past the edge, where the
+						 * terminal would wrap it out of
+						 * step, starts the next line */
+						int char_end = render_x;
+						if (wrapCharColumn(row, char_idx,
+								   &char_end,
+								   screencols) !=
+						    render_x)
+							break;
+
+						setHighlight(ab,
+							     &current_highlight,
+							     highlightAt(&hl,
+									 render_x));
 
 						if (c == '\t') {
-							int next_tab_stop =
-								(render_x +
-								 EMSYS_TAB_STOP) /
-								EMSYS_TAB_STOP *
-								EMSYS_TAB_STOP;
-							int tab_end =
-								next_tab_stop;
-							if (tab_end -
-								    line_start_render_x >
-							    screencols) {
-								tab_end =
-									line_start_render_x +
-									screencols;
-							}
 							while (render_x <
-							       tab_end) {
+							       char_end) {
 								// Check highlighting for each space in tab
-								int space_in_region = isRenderPosInRegion(
-									buf,
-									filerow,
-									render_x);
-								int space_is_match = isRenderPosCurrentSearchMatch(
-									buf,
-									filerow,
-									render_x);
-								int space_highlight =
-									(space_in_region ||
-									 space_is_match) ?
-										1 :
-										0;
-								if (space_highlight !=
-								    current_highlight) {
-									if (current_highlight >
-									    0) {
-										abAppend(
-											ab,
-											"\x1b[0m",
-											4);
-									}
-									if (space_highlight ==
-									    1) {
-										abAppend(
-											ab,
-											"\x1b[7m",
-											4);
-									}
-									current_highlight =
-										space_highlight;
-								}
+								setHighlight(
+									ab,
+									&current_highlight,
+									highlightAt(
+										&hl,
+										render_x));
 								abAppend(ab,
 									 " ",
 									 1);
@@ -611,11 +582,7 @@ void drawRows(struct editorWindow *win, struct abuf *ab, int screenrows,
 									 &sym,
 									 1);
 							}
-							render_x += 2;
 						} else {
-							int width = charInStringWidth(
-								row->chars,
-								char_idx);
 							int bytes =
 								utf8_nBytes(c);
 							abAppend(
@@ -623,61 +590,31 @@ void drawRows(struct editorWindow *win, struct abuf *ab, int screenrows,
 								(char *)&row->chars
 									[char_idx],
 								bytes);
-							render_x += width;
 						}
+						render_x = char_end;
 
 						char_idx += utf8_nBytes(
 							row->chars[char_idx]);
 					}
 
 					// Fill rest of line with highlighted spaces if in region
-					while (render_x - line_start_render_x <
-					       screencols) {
-						int space_in_region =
-							isRenderPosInRegion(
-								buf, filerow,
-								render_x);
-						int space_is_match =
-							isRenderPosCurrentSearchMatch(
-								buf, filerow,
-								render_x);
-						int space_highlight =
-							(space_in_region ||
-							 space_is_match) ?
-								1 :
-								0;
-						if (space_highlight !=
-						    current_highlight) {
-							if (current_highlight >
-							    0) {
-								abAppend(
-									ab,
-									"\x1b[0m",
-									4);
-							}
-							if (space_highlight ==
-							    1) {
-								abAppend(
-									ab,
-									"\x1b[7m",
-									4);
-							}
-							current_highlight =
-								space_highlight;
-						}
+					while (render_x < line_end) {
+						setHighlight(ab,
+							     &current_highlight,
+							     highlightAt(&hl,
+									 render_x));
 						abAppend(ab, " ", 1);
 						render_x++;
 					}
 
 					// Reset highlighting at end of screen line
-					if (current_highlight > 0) {
-						abAppend(ab, "\x1b[0m", 4);
-						current_highlight = 0;
-					}
+					setHighlight(ab, &current_highlight, 0);
 
-					// Move to next screen line if there's more content
-					if (char_idx < row->size &&
-					    y < screenrows - 1) {
+					// Move to next screen line if the row has one,
+					// even an empty one after a full last line
+					if (render_x / screencols <= last_line) {
+						if (y == screenrows - 1)
+							break;
 						abAppend(ab, "\r\n", 2);
 						y++;
 					}
@@ -720,6 +657,13 @@ void drawStatusBar(struct editorWindow *win, struct abuf *ab, int line) {
 			       bufr->read_only ? '%' : ' ', win->cy + 1,
 			       win->cx);
 	}
+	if (bufr->load != NULL && len < (int)sizeof(status)) {
+		len += snprintf(&status[len], sizeof(status) - len,
+				" Loading %d%% --",
+				(int)(bufr->load->done * 100 / bufr->load->len));
+		if (len >= (int)sizeof(status))
+			len = sizeof(status) - 1;
+	}
 #ifdef EMSYS_DEBUG_UNDO
 #ifdef EMSYS_DEBUG_REDO
 #define DEBUG_UNDO bufr->redo
@@ -817,9 +761,18 @@ void drawMinibuffer(struct abuf *ab) {
 }
 
 void refreshScreen(void) {
-	struct abuf ab = ABUF_INIT;
-	abAppend(&ab, "\x1b[?25l", 6); // Hide cursor
-	abAppend(&ab, "\x1b[H", 3);    // Move cursor to top-left corner
+	/* Frames are drawn into the same buffer every time, so once it has
+	 * grown to fit one nothing is allocated.  A redraw from a signal
+	 * handler in the middle of a frame gets one of its own. */
+	static struct abuf frame = ABUF_INIT;
+	static int drawing;
+	struct abuf nested = ABUF_INIT;
+	int outer = !drawing;
+	struct abuf *ab = outer ? &frame : &nested;
+	drawing = 1;
+	abReset(ab);
+	abAppend(ab, "\x1b[?25l", 6); // Hide cursor
+	abAppend(ab, "\x1b[H", 3);    // Move cursor to top-left corner
 
 	int focusedIdx = windowFocusedIdx();
 
@@ -853,15 +806,15 @@ void refreshScreen(void) {
 
 		if (win->focused)
 			scroll();
-		drawRows(win, &ab, win->height, E.screencols);
+		drawRows(win, ab, win->height, E.screencols);
 		cumulative_height += win->height + statusbar_height;
-		drawStatusBar(win, &ab, cumulative_height);
+		drawStatusBar(win, ab, cumulative_height);
 	}
 
-	drawMinibuffer(&ab);
+	drawMinibuffer(ab);
 
 	// Clear any remaining lines below content
-	abAppend(&ab, "\x1b[J", 3);
+	abAppend(ab, "\x1b[J", 3);
 
 	// Position the cursor for the focused window
 	struct editorWindow *focusedWin = E.windows[focusedIdx];
@@ -884,13 +837,16 @@ void refreshScreen(void) {
 
 	snprintf(buf, sizeof(buf), "\x1b[%d;%dH", cursor_y,
 		 focusedWin->scx + 1);
-	abAppend(&ab, buf, strlen(buf));
+	abAppend(ab, buf, strlen(buf));
 
-	abAppend(&ab, "\x1b[?25h", 6); // Show cursor
+	abAppend(ab, "\x1b[?25h", 6); // Show cursor
 
-	write(STDOUT_FILENO, ab.b, ab.len);
+	screenUpdate(ab->b, ab->len);
 
-	abFree(&ab);
+	if (outer)
+		drawing = 0;
+	else
+		abFree(ab);
 }
 
 void cursorBottomLine(int curs) {
@@ -922,6 +878,7 @@ void editorSetStatusMessage(const char *fmt, ...) {
 void editorResizeScreen(int UNUSED(sig)) {
 	if (getWindowSize(&E.screenrows, &E.screencols) == -1)
 		die("getWindowSize");
+	screenInvalidate();
 	refreshScreen();
 }
 
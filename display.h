@@ -23,6 +23,7 @@ extern const int statusbar_height;
 
 /* Append buffer operations */
 void abAppend(struct abuf *ab, const char *s, int len);
+void abReset(struct abuf *ab);
 void abFree(struct abuf *ab);
 
 /* Display functions */
@@ -22,12 +22,13 @@ static void addToKillRing(const char *text) {
 	if (!text || strlen(text) == 0)
 		return;
 
-	addHistory(&E.kill_history, text);
+	char *copy = xstrdup(text);
+	addHistory(&E.kill_history, copy);
 	E.kill_ring_pos = -1; /* Reset position for M-y */
 
 	/* Update E.kill to point to the new kill */
 	free(E.kill);
-	E.kill = xstrdup((uint8_t *)text);
+	E.kill = (uint8_t *)copy;
 }
 
 /* Character insertion */
@@ -98,7 +99,7 @@ void editorInsertNewline(struct editorBuffer *bufr, int count) {
 			row = &bufr->row[bufr->cy];
 			row->size = bufr->cx;
 			row->chars[row->size] = '\0';
-			row->render_valid = 0;
+			invalidateRow(bufr, row);
 		}
 		bufr->cy++;
 		bufr->cx = 0;
@@ -188,7 +189,7 @@ UNINDENT_PERFORM:
 		return;
 
 	/* Create undo */
-	struct editorUndo *new = newUndo();
+	struct editorUndo *new = newUndo(bufr);
 	new->prev = bufr->undo;
 	new->startx = 0;
 	new->starty = bufr->cy;
@@ -197,10 +198,7 @@ UNINDENT_PERFORM:
 	new->delete = 1;
 	new->append = 0;
 	bufr->undo = new;
-	if (new->datasize < trunc - 1) {
-		new->datasize = trunc + 1;
-		new->data = xrealloc(new->data, new->datasize);
-	}
+	undoReserve(new, trunc + 1);
 	memset(new->data, indCh, trunc);
 	new->data[trunc] = 0;
 	new->datalen = trunc;
@@ -209,7 +207,7 @@ UNINDENT_PERFORM:
 	memmove(&row->chars[0], &row->chars[trunc], row->size - trunc);
 	row->size -= trunc;
 	bufr->cx -= trunc;
-	updateRow(row);
+	invalidateRow(bufr, row);
 	bufr->dirty = 1;
 }
 
@@ -632,7 +630,7 @@ void editorKillLine(int count) {
 			free(killed_text);
 
 			clearRedos(E.buf);
-			struct editorUndo *new = newUndo();
+			struct editorUndo *new = newUndo(E.buf);
 			new->starty = E.buf->cy;
 			new->endy = E.buf->cy;
 			new->startx = E.buf->cx;
@@ -642,10 +640,7 @@ void editorKillLine(int count) {
 			E.buf->undo = new;
 
 			new->datalen = kill_len;
-			if (new->datasize < new->datalen + 1) {
-				new->datasize = new->datalen + 1;
-				new->data = xrealloc(new->data, new->datasize);
-			}
+			undoReserve(new, new->datalen + 1);
 			for (int i = 0; i < kill_len; i++) {
 				new->data[i] = E.kill[kill_len - i - 1];
 			}
@@ -653,7 +648,7 @@ void editorKillLine(int count) {
 
 			row->size = E.buf->cx;
 			row->chars[row->size] = '\0';
-			row->render_valid = 0;
+			invalidateRow(E.buf, row);
 			E.buf->dirty = 1;
 			editorClearMark();
 		}
@@ -675,7 +670,7 @@ void editorKillLineBackwards(void) {
 	free(killed_text);
 
 	clearRedos(E.buf);
-	struct editorUndo *new = newUndo();
+	struct editorUndo *new = newUndo(E.buf);
 	new->starty = E.buf->cy;
 	new->endy = E.buf->cy;
 	new->startx = 0;
@@ -685,10 +680,7 @@ void editorKillLineBackwards(void) {
 	E.buf->undo = new;
 
 	new->datalen = E.buf->cx;
-	if (new->datasize < new->datalen + 1) {
-		new->datasize = new->datalen + 1;
-		new->data = xrealloc(new->data, new->datasize);
-	}
+	undoReserve(new, new->datalen + 1);
 	for (int i = 0; i < E.buf->cx; i++) {
 		new->data[i] = E.kill[E.buf->cx - i - 1];
 	}
@@ -697,7 +689,7 @@ void editorKillLineBackwards(void) {
 	row->size -= E.buf->cx;
 	memmove(row->chars, &row->chars[E.buf->cx], row->size);
 	row->chars[row->size] = '\0';
-	updateRow(row);
+	invalidateRow(E.buf, row);
 	E.buf->cx = 0;
 	E.buf->dirty = 1;
 }
@@ -728,41 +720,27 @@ void editorPageUp(int count) {
 			/* If cursor is above window, it's already visible */
 		} else {
 			/* In wrapped mode, need to handle variable line heights */
-			int lines_scrolled = 0;
-			int new_rowoff = win->rowoff;
-
-			/* Scroll up by the desired number of screen lines */
-			while (lines_scrolled < scroll_lines &&
-			       new_rowoff > 0) {
-				new_rowoff--;
-				int line_height =
-					(calculateLineWidth(
-						 &E.buf->row[new_rowoff]) /
-					 E.screencols) +
-					1;
-				lines_scrolled += line_height;
-			}
-			win->rowoff = new_rowoff;
+			/* Scroll up by the desired number of screen lines, to
+			 * the last row starting that far up */
+			int top = getScreenLineForRow(E.buf, win->rowoff);
+			win->rowoff = 0;
+			if (top > scroll_lines)
+				win->rowoff = getRowForScreenLine(
+						      E.buf, top - scroll_lines + 1) -
+					      1;
 
 			/* Ensure cursor is visible - calculate screen position */
-			int cursor_screen_line =
-				getScreenLineForRow(E.buf, E.buf->cy);
-			int window_start_screen_line =
-				getScreenLineForRow(E.buf, win->rowoff);
-
-			if (cursor_screen_line >=
-			    window_start_screen_line + win->height) {
-				/* Cursor is below window - move it up to be within window */
-				while (E.buf->cy > 0) {
-					cursor_screen_line =
-						getScreenLineForRow(E.buf,
-								    E.buf->cy);
-					if (cursor_screen_line <
-					    window_start_screen_line +
-						    win->height)
-						break;
-					E.buf->cy--;
-				}
+			int window_end_screen_line =
+				getScreenLineForRow(E.buf, win->rowoff) +
+				win->height;
+
+			if (getScreenLineForRow(E.buf, E.buf->cy) >=
+			    window_end_screen_line) {
+				/* Cursor is below window - move it up to the last
+				 * row starting within it */
+				E.buf->cy = getRowForScreenLine(
+						    E.buf, window_end_screen_line) -
+					    1;
 			}
 		}
 
@@ -802,26 +780,10 @@ void editorPageDown(int count) {
 			/* If cursor is below window, it's already visible */
 		} else {
 			/* In wrapped mode, need to handle variable line heights */
-			int lines_scrolled = 0;
-			int new_rowoff = win->rowoff;
-
 			/* Scroll down by the desired number of screen lines */
-			while (lines_scrolled < scroll_lines &&
-			       new_rowoff < E.buf->numrows) {
-				int line_height =
-					(calculateLineWidth(
-						 &E.buf->row[new_rowoff]) /
-					 E.screencols) +
-					1;
-				lines_scrolled += line_height;
-				new_rowoff++;
-			}
-
-			/* Don't scroll too far */
-			if (new_rowoff > E.buf->numrows) {
-				new_rowoff = E.buf->numrows;
-			}
-			win->rowoff = new_rowoff;
+			win->rowoff = getRowForScreenLine(
+				E.buf, getScreenLineForRow(E.buf, win->rowoff) +
+					       scroll_lines);
 
 			/* Ensure cursor is visible - calculate screen position */
 			int cursor_screen_line =
@@ -28,17 +28,83 @@ enum promptType {
 };
 /*** data ***/
 
+/* A point in a long row, kept every so many columns to seek from */
+struct columnMark {
+	int byte; /* the last character starting at or before it */
+	int col; /* the column that character starts at */
+};
+
 typedef struct erow {
 	int size;
-	int rsize;
-	int renderwidth;
+	int borrowed; /* chars points into a text block, not its own malloc */
 	uint8_t *chars;
-	uint8_t *render;
 	int cached_width;
 	int width_valid;
-	int render_valid;
+	/* Screen width wrap_width is for.  Negative while width_valid if
+	 * wrapping at any multiple of -wrap_cols leaves no column empty. */
+	int wrap_cols;
+	int wrap_width; /* wrappedDisplayColumn of the row's end */
+	struct columnMark *marks; /* current while width_valid is */
+	int nmarks;
+	int marks_cap;
+	size_t capacity; /* bytes allocated for chars, 0 while borrowed */
 } erow;
 
+#define ROW_SLAB_CLASSES 9 /* 16, 32, ... 4096 byte slots */
+
+/* Per-buffer storage for the bytes of rows that have their own copy */
+struct editorRowArena {
+	struct editorRowChunk *chunks;
+	uint8_t *bump;
+	size_t left;
+	void *free[ROW_SLAB_CLASSES];
+	struct editorRowLarge *large;
+};
+
+/* File text that rows borrow their chars from until they need to grow */
+struct editorTextBlock {
+	struct editorTextBlock *next;
+	uint8_t *data;
+	size_t len;
+	int mapped; /* data is a private file mapping, not malloc'd */
+	int lost; /* the file shrank and some pages now read as zeros */
+};
+
+/* Enough of a file's status to notice it changing on disk */
+struct editorFileStamp {
+	int known;
+	uintmax_t dev;
+	uintmax_t ino;
+	intmax_t size;
+	time_t mtime;
+};
+
+/* A file being split into rows a step at a time between keystrokes */
+struct editorLoad {
+	int fd; /* -1 once all of the file is in text */
+	uint8_t *text;
+	size_t len; /* file size */
+	size_t avail; /* bytes of text read so far */
+	size_t done; /* bytes already split into rows */
+	int mapped;
+	int read_only; /* restored when the load finishes */
+};
+
+/* Bytes of undo history a buffer keeps in memory; older history is
+ * spilled to a temporary file */
+#ifndef EMSYS_UNDO_BUDGET
+#define EMSYS_UNDO_BUDGET (8 << 20)
+#endif
+
+/* Least undo payload between two checkpoints of a buffer's text; they
+ * are spaced further apart for buffers larger than this */
+#ifndef EMSYS_UNDO_CHECKPOINT
+#define EMSYS_UNDO_CHECKPOINT (256 << 10)
+#endif
+
+/* Payload bytes an undo record holds without a separate allocation */
+#define UNDO_INLINE 22
+
 struct editorUndo {
 	struct editorUndo *prev;
 	int startx;
@@ -47,10 +113,53 @@ struct editorUndo {
 	int endy;
 	int append;
 	int datalen;
-	int datasize;
+	int datasize; /* room from data onwards */
+	int front; /* headroom below data, so it can grow at both ends */
 	int delete;
 	int paired;
-	uint8_t *data;
+	uint8_t *data; /* inline until it outgrows it */
+	uint8_t inline_data[UNDO_INLINE];
+};
+
+#define UNDO_CHUNK 128
+
+struct editorUndoChunk {
+	struct editorUndoChunk *next;
+	struct editorUndo undos[UNDO_CHUNK];
+};
+
+/* Undo records are carved from per-buffer chunks and recycled */
+struct editorUndoPool {
+	struct editorUndoChunk *chunks;
+	int used; /* records handed out from the newest chunk */
+	struct editorUndo *free; /* linked through prev */
+};
+
+/* Spilled undo records, oldest first, in an unlinked temporary file */
+struct editorUndoJournal {
+	int fd; /* -1 until something is spilled */
+	size_t len; /* bytes in use */
+	int records;
+};
+
+/* The buffer's text as it was after the first seq records of history */
+struct editorUndoCheckpoint {
+	int seq;
+	int numrows;
+	int cx, cy;
+	size_t at; /* offset of the rows in the checkpoint file */
+	size_t len;
+};
+
+/* Checkpoints, oldest first, with their text in an unlinked file */
+struct editorUndoCheckpoints {
+	int fd; /* -1 until the first checkpoint */
+	size_t len; /* bytes in use */
+	struct editorUndoCheckpoint *list;
+	int n;
+	int cap;
+	size_t gap; /* payload to record before the next one */
+	size_t since; /* payload recorded since the newest one */
 };
 
 struct completion_state {
@@ -83,15 +192,28 @@ struct editorBuffer {
 	int single_line;
 	int read_only;
 	erow *row;
+	struct editorTextBlock *blocks;
+	struct editorRowArena arena;
+	struct editorLoad *load; /* non-NULL while still loading */
 	char *filename;
+	struct editorFileStamp stamp; /* the file as last read or written */
 	uint8_t *query;
 	uint8_t match;
 	struct editorUndo *undo;
 	struct editorUndo *redo;
+	struct editorUndoPool undo_pool;
+	int undo_group_seq; /* undo_seq as the group began, -1 once undone */
+	int undo_group_depth;
+	size_t undo_bytes; /* held by undo records below the newest */
+	size_t undo_budget;
+	struct editorUndoJournal undo_journal;
+	int undo_seq; /* records from the start of history to the newest */
+	struct editorUndoCheckpoints undo_checkpoints;
 	struct editorBuffer *next;
-	int *screen_line_start;
+	int *screen_line_tree; /* Fenwick tree of screen lines per row */
 	int screen_line_cache_size;
-	int screen_line_cache_valid;
+	int screen_line_cols;
+	int screen_line_cache_rows; /* rows whose tree entries are current */
 	struct completion_state completion_state;
 };
 
@@ -212,7 +334,6 @@ struct editorConfig {
 uint8_t *editorPrompt(struct editorBuffer *bufr, uint8_t *prompt,
 		      enum promptType t,
 		      void (*callback)(struct editorBuffer *, uint8_t *, int));
-void editorUpdateBuffer(struct editorBuffer *buf);
 void editorInsertNewline(struct editorBuffer *bufr, int count);
 void editorInsertChar(struct editorBuffer *bufr, int c, int count);
 void editorOpen(struct editorBuffer *bufr, char *filename);
@@ -4,6 +4,7 @@
 #include "fileio.h"
 #include "buffer.h"
 #include <errno.h>
+#include <stdint.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -11,12 +12,17 @@
 #include <unistd.h>
 #include <time.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <limits.h>
+#ifndef EMSYS_DISABLE_MMAP
+#include <sys/mman.h>
+#endif
 #include <sys/select.h>
 #include "display.h"
 #include "prompt.h"
 #include "util.h"
-#include "undo.h"
 #include "keymap.h"
+#include "terminal.h"
 #include "unused.h"
 
 /* Access global editor state */
@@ -27,32 +33,135 @@ extern void die(const char *s);
 
 /*** file i/o ***/
 
-char *editorRowsToString(struct editorBuffer *bufr, int *buflen) {
-	int totlen = 0;
-	int j;
-	for (j = 0; j < bufr->numrows; j++) {
-		totlen += bufr->row[j].size + 1;
+/* Bytes of a file split into rows per load step */
+#define LOAD_STEP (4 << 20)
+
+/* iovecs per writev when saving; two per row */
+#if defined(IOV_MAX) && IOV_MAX < 1024
+#define SAVE_IOV IOV_MAX
+#else
+#define SAVE_IOV 1024
+#endif
+
+/* Reads all of fd into one heap block with a spare byte at the end */
+static uint8_t *readFileText(int fd, size_t *lenp) {
+	struct stat st;
+	size_t cap = 4096;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+	    (uintmax_t)st.st_size < SIZE_MAX)
+		cap = (size_t)st.st_size + 1;
+
+	uint8_t *text = xmalloc(cap);
+	size_t len = 0;
+	for (;;) {
+		if (len + 1 >= cap) {
+			if (cap > SIZE_MAX / 2)
+				die("file too large");
+			cap *= 2;
+			text = xrealloc(text, cap);
+		}
+		ssize_t n = read(fd, text + len, cap - len - 1);
+		if (n == 0)
+			break;
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			free(text);
+			return NULL;
+		}
+		len += n;
 	}
-	*buflen = totlen;
+	*lenp = len;
+	return text;
+}
 
-	char *buf = xmalloc(totlen);
-	char *p = buf;
-	for (j = 0; j < bufr->numrows; j++) {
-		memcpy(p, bufr->row[j].chars, bufr->row[j].size);
-		p += bufr->row[j].size;
-		*p = '\n';
-		p++;
-	}
+#ifndef EMSYS_DISABLE_MMAP
+/*
+ * Maps a regular file privately.  Only the pages that are looked at get
+ * faulted in, and rows stay backed by the page cache until edited.
+ */
+static uint8_t *mapFileText(int fd, size_t *lenp) {
+	struct stat st;
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size <= 0 ||
+	    (uintmax_t)st.st_size >= SIZE_MAX)
+		return NULL;
+
+	size_t len = (size_t)st.st_size;
+	void *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		return NULL;
+	/* Line indexing walks the file front to back */
+	posix_madvise(map, len, POSIX_MADV_SEQUENTIAL);
+	posix_madvise(map, len < 1 << 20 ? len : 1 << 20, POSIX_MADV_WILLNEED);
+	*lenp = len;
+	return map;
+}
+#endif
+
+static void stampFile(struct editorFileStamp *stamp, const struct stat *st) {
+	stamp->known = 1;
+	stamp->dev = st->st_dev;
+	stamp->ino = st->st_ino;
+	stamp->size = st->st_size;
+	stamp->mtime = st->st_mtime;
+}
+
+/* Whether bufr's file is no longer the one it was read from or last
+ * written to.  A file that has gone away doesn't count. */
+static int fileChanged(struct editorBuffer *bufr, const char *path) {
+	struct editorFileStamp now;
+	struct stat st;
+	if (!bufr->stamp.known || path == NULL || stat(path, &st) != 0)
+		return 0;
+	stampFile(&now, &st);
+	return now.dev != bufr->stamp.dev || now.ino != bufr->stamp.ino ||
+	       now.size != bufr->stamp.size || now.mtime != bufr->stamp.mtime;
+}
 
-	return buf;
+/*
+ * Loads filename as one text block at row at.  Returns the number of
+ * lines inserted, or -1 with errno set if the file can't be read.  If
+ * stamp isn't NULL it is set from the file that was read.  Only then
+ * is the file mapped: editorCheckFile watches nothing but the stamped
+ * file, so text from any other one is read in.
+ */
+static int insertFileText(struct editorBuffer *bufr, int at,
+			  const char *filename, struct editorFileStamp *stamp) {
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	struct stat st;
+	if (stamp != NULL && fstat(fd, &st) == 0)
+		stampFile(stamp, &st);
+
+	size_t len;
+	uint8_t *text;
+#ifndef EMSYS_DISABLE_MMAP
+	text = stamp != NULL ? mapFileText(fd, &len) : NULL;
+	if (text != NULL) {
+		close(fd);
+		int lines = editorInsertTextBlock(bufr, at, text, len, 1);
+		posix_madvise(text, len, POSIX_MADV_NORMAL);
+		return lines;
+	}
+#endif
+	text = readFileText(fd, &len);
+	int saved_errno = errno;
+	close(fd);
+	if (text == NULL) {
+		errno = saved_errno;
+		return -1;
+	}
+	/* Lines borrow from the block, so loading costs one read instead
+	 * of a malloc per line. */
+	return editorInsertTextBlock(bufr, at, text, len, 0);
 }
 
 void editorOpen(struct editorBuffer *bufr, char *filename) {
 	free(bufr->filename);
 	bufr->filename = xstrdup(filename);
 
-	FILE *fp = fopen(filename, "r");
-	if (!fp) {
+	if (insertFileText(bufr, bufr->numrows, filename, &bufr->stamp) < 0) {
 		if (errno == ENOENT) {
 			editorSetStatusMessage("(New file)", bufr->filename);
 			return;
@@ -60,21 +169,160 @@ void editorOpen(struct editorBuffer *bufr, char *filename) {
 		editorSetStatusMessage("Can't open file: %s", strerror(errno));
 		return;
 	}
+	bufr->dirty = 0;
+}
 
-	char *line = NULL;
-	size_t linecap = 0;
-	ssize_t linelen;
+/*
+ * Starts loading filename into bufr a step at a time.  The first step
+ * runs now so there is a screenful to show; the main loop runs the rest
+ * with editorLoadStep while no input is waiting.  The buffer is read-only
+ * until the load finishes.  Small files and anything that isn't a
+ * regular file are loaded in one go with editorOpen.
+ */
+void editorStartLoad(struct editorBuffer *bufr, char *filename) {
+	struct stat st;
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+	    st.st_size <= LOAD_STEP || (uintmax_t)st.st_size >= SIZE_MAX) {
+		if (fd >= 0)
+			close(fd);
+		editorOpen(bufr, filename);
+		return;
+	}
 
-	while ((linelen = emsys_getline(&line, &linecap, fp)) != -1) {
-		while (linelen > 0 &&
-		       (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
-			linelen--;
-		editorInsertRow(bufr, bufr->numrows, line, linelen);
+	size_t len = (size_t)st.st_size;
+	uint8_t *text = NULL;
+	int mapped = 0;
+#ifndef EMSYS_DISABLE_MMAP
+	text = mapFileText(fd, &len);
+	if (text != NULL) {
+		close(fd);
+		fd = -1;
+		mapped = 1;
 	}
+#endif
+	if (text == NULL) {
+		/* Rows borrow from the block, so it can't move as it fills */
+		text = xmalloc(len + 1);
+	}
+
+	free(bufr->filename);
+	bufr->filename = xstrdup(filename);
+	stampFile(&bufr->stamp, &st);
+	editorAddTextBlock(bufr, text, len, mapped);
+
+	struct editorLoad *load = xmalloc(sizeof(*load));
+	load->fd = fd;
+	load->text = text;
+	load->len = len;
+	load->avail = mapped ? len : 0;
+	load->done = 0;
+	load->mapped = mapped;
+	load->read_only = bufr->read_only;
+	bufr->load = load;
+	bufr->read_only = 1;
+	editorLoadStep(bufr);
+}
 
-	free(line);
-	fclose(fp);
+/*
+ * Splits about LOAD_STEP more bytes of the file into rows appended to
+ * the buffer.  Returns nonzero while there is more to load.
+ */
+int editorLoadStep(struct editorBuffer *bufr) {
+	struct editorLoad *load = bufr->load;
+	if (load == NULL)
+		return 0;
+
+	size_t want = load->done + LOAD_STEP;
+	if (want > load->len)
+		want = load->len;
+	while (load->fd >= 0 && load->avail < want) {
+		ssize_t n = read(load->fd, load->text + load->avail,
+				 want - load->avail);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			if (n < 0)
+				editorSetStatusMessage("Can't read file: %s",
+						       strerror(errno));
+			load->len = load->avail;
+			break;
+		}
+		load->avail += n;
+	}
+	if (load->fd >= 0 && load->avail == load->len) {
+		close(load->fd);
+		load->fd = -1;
+	}
+
+	/* Step whole lines, however long, so every step makes progress */
+	size_t end = want < load->avail ? want : load->avail;
+	if (end < load->avail) {
+		uint8_t *nl = memchr(load->text + end, '\n', load->avail - end);
+		end = nl != NULL ? (size_t)(nl - load->text) + 1 : load->avail;
+	}
+	int final = load->fd < 0 && end == load->len;
+
+	size_t used;
+	editorInsertLines(bufr, bufr->numrows, load->text + load->done,
+			  end - load->done, load->mapped, final, &used);
+	load->done += used;
 	bufr->dirty = 0;
+	if (!final)
+		return 1;
+
+#ifndef EMSYS_DISABLE_MMAP
+	if (load->mapped)
+		posix_madvise(load->text, load->len, POSIX_MADV_NORMAL);
+#endif
+	bufr->read_only = load->read_only;
+	free(load);
+	bufr->load = NULL;
+	return 0;
+}
+
+/* Stops loading bufr, keeping the rows loaded so far read-only */
+void editorCancelLoad(struct editorBuffer *bufr) {
+	struct editorLoad *load = bufr->load;
+	if (load == NULL)
+		return;
+	if (load->fd >= 0)
+		close(load->fd);
+	free(load);
+	bufr->load = NULL;
+}
+
+/* The buffer to load next, preferring the one being looked at */
+struct editorBuffer *editorLoadingBuffer(void) {
+	if (E.buf->load != NULL)
+		return E.buf;
+	for (struct editorBuffer *buf = E.headbuf; buf != NULL;
+	     buf = buf->next) {
+		if (buf->load != NULL)
+			return buf;
+	}
+	return NULL;
+}
+
+/*
+ * Notices bufr's file changing on disk while rows still borrow from a
+ * mapping of it.  Pages of a private mapping that were never written
+ * follow the file, and pages past a new end of file read as zeros, so
+ * the rows are given their own copies straight away and the user is
+ * told.
+ */
+void editorCheckFile(struct editorBuffer *bufr) {
+	if (bufr->load != NULL || !editorHasMappedText(bufr))
+		return;
+	if (!editorMappedTextLost(bufr) && !fileChanged(bufr, bufr->filename))
+		return;
+	if (editorDetachRows(bufr))
+		editorSetStatusMessage(
+			"%.20s shrank on disk; text past its end is lost",
+			bufr->filename);
+	else
+		editorSetStatusMessage("%.20s changed on disk",
+				       bufr->filename);
 }
 
 void editorRevert(struct editorConfig *ed, struct editorBuffer *buf) {
@@ -113,7 +361,145 @@ void editorRevert(struct editorConfig *ed, struct editorBuffer *buf) {
 	destroyBuffer(buf);
 }
 
+/*
+ * Writes every row of bufr to fd, a bounded batch of rows per writev,
+ * so saving never needs a second copy of the buffer.  Returns the
+ * number of bytes written, or -1 with errno set.
+ */
+ssize_t editorWriteRows(int fd, struct editorBuffer *bufr) {
+	static char newline[] = "\n";
+	struct iovec iov[SAVE_IOV];
+	size_t total = 0;
+	int row = 0;
+
+	while (row < bufr->numrows) {
+		int n = 0;
+		while (row < bufr->numrows && n + 2 <= SAVE_IOV) {
+			iov[n].iov_base = bufr->row[row].chars;
+			iov[n++].iov_len = bufr->row[row].size;
+			iov[n].iov_base = newline;
+			iov[n++].iov_len = 1;
+			row++;
+		}
+
+		struct iovec *next = iov;
+		while (n > 0) {
+			ssize_t wrote = writev(fd, next, n);
+			if (wrote < 0) {
+				if (errno == EINTR)
+					continue;
+				return -1;
+			}
+			total += wrote;
+			/* Skip what went out and retry the rest */
+			while (n > 0 && (size_t)wrote >= next->iov_len) {
+				wrote -= next->iov_len;
+				next++;
+				n--;
+			}
+			if (n > 0) {
+				next->iov_base = (char *)next->iov_base + wrote;
+				next->iov_len -= wrote;
+			}
+		}
+	}
+	return total;
+}
+
+/*
+ * Writes bufr to a temporary file beside path, syncs it and renames it
+ * over path, so a crash leaves either the old file or the new one.
+ * The old file's permissions are kept.  Returns the bytes written, or
+ * -1 with errno set.
+ */
+static ssize_t saveAtomically(struct editorBuffer *bufr, const char *path) {
+	size_t pathlen = strlen(path);
+	char *tmp = xmalloc(pathlen + sizeof(".XXXXXX"));
+	memcpy(tmp, path, pathlen);
+	memcpy(tmp + pathlen, ".XXXXXX", sizeof(".XXXXXX"));
+
+	int fd = mkstemp(tmp);
+	if (fd < 0) {
+		free(tmp);
+		return -1;
+	}
+
+	struct stat st;
+	if (stat(path, &st) == 0) {
+		if (fchown(fd, st.st_uid, st.st_gid) != 0) {
+			/* Only root can give files away; keep ours */
+		}
+		fchmod(fd, st.st_mode & 07777);
+	} else {
+		mode_t mask = umask(0);
+		umask(mask);
+		fchmod(fd, 0666 & ~mask);
+	}
+
+	ssize_t written = editorWriteRows(fd, bufr);
+	if (written < 0 || fsync(fd) != 0) {
+		int saved_errno = errno;
+		close(fd);
+		errno = saved_errno;
+		written = -1;
+	} else if (close(fd) != 0 || rename(tmp, path) != 0) {
+		written = -1;
+	}
+	if (written < 0) {
+		int saved_errno = errno;
+		unlink(tmp);
+		free(tmp);
+		errno = saved_errno;
+		return -1;
+	}
+	free(tmp);
+
+	/* Make the rename itself durable */
+	char *dir = xstrdup(path);
+	char *slash = strrchr(dir, '/');
+	if (slash == dir)
+		slash[1] = '\0';
+	else if (slash != NULL)
+		*slash = '\0';
+	int dirfd = open(slash != NULL ? dir : ".", O_RDONLY);
+	if (dirfd >= 0) {
+		fsync(dirfd);
+		close(dirfd);
+	}
+	free(dir);
+	return written;
+}
+
+/*
+ * Rewrites path in place.  Used when the directory won't take a
+ * temporary file, at the cost of atomicity.
+ */
+static ssize_t saveInPlace(struct editorBuffer *bufr, const char *path) {
+	/* Truncating the file under a private mapping would fault any row
+	 * still borrowed from it, so give them their own copies first. */
+	if (editorHasMappedText(bufr))
+		editorDetachRows(bufr);
+
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0)
+		return -1;
+	ssize_t written = editorWriteRows(fd, bufr);
+	if (written < 0 || fsync(fd) != 0) {
+		int saved_errno = errno;
+		close(fd);
+		errno = saved_errno;
+		return -1;
+	}
+	if (close(fd) != 0)
+		return -1;
+	return written;
+}
+
 void editorSave(struct editorBuffer *bufr) {
+	if (bufr->read_only) {
+		editorSetStatusMessage("Buffer is read-only");
+		return;
+	}
 	if (bufr->filename == NULL) {
 		bufr->filename = (char *)editorPrompt(
 			bufr, (uint8_t *)"Save as: %s", PROMPT_FILES, NULL);
@@ -123,31 +509,50 @@ void editorSave(struct editorBuffer *bufr) {
 		}
 	}
 
-	int len;
-	char *buf = editorRowsToString(bufr, &len);
-
-	int fd = open(bufr->filename, O_RDWR | O_CREAT, 0644);
-	if (fd != -1) {
-		if (ftruncate(fd, len) != -1) {
-			if (write(fd, buf, len)) {
-				close(fd);
-				free(buf);
-				bufr->dirty = 0;
-
-				// Clear undo/redo on successful save
-				clearUndosAndRedos(bufr);
-
-				editorSetStatusMessage(
-					"Wrote %d bytes to %s (undo history cleared)",
-					len, bufr->filename);
-				return;
-			}
+	/* Replace what a symlink points at, not the link itself */
+	char *path = realpath(bufr->filename, NULL);
+	if (path == NULL)
+		path = xstrdup(bufr->filename);
+
+	if (fileChanged(bufr, path)) {
+		editorSetStatusMessage(
+			"%.20s changed on disk; save anyway? (y or n)",
+			bufr->filename);
+		refreshScreen();
+		int c = editorReadKey();
+		if (c != 'y' && c != 'Y') {
+			editorSetStatusMessage("Save aborted.");
+			free(path);
+			return;
 		}
-		close(fd);
 	}
 
-	free(buf);
-	editorSetStatusMessage("Save failed: %s", strerror(errno));
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ssize_t written = saveAtomically(bufr, path);
+	if (written < 0 && (errno == EACCES || errno == EPERM ||
+			    errno == EROFS))
+		written = saveInPlace(bufr, path);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if (written < 0) {
+		editorSetStatusMessage("Save failed: %s", strerror(errno));
+		free(path);
+		return;
+	}
+
+	struct stat st;
+	if (stat(path, &st) == 0)
+		stampFile(&bufr->stamp, &st);
+	free(path);
+	bufr->dirty = 0;
+
+	double secs = (end.tv_sec - start.tv_sec) +
+		      (end.tv_nsec - start.tv_nsec) / 1e9;
+	editorSetStatusMessage(
+		"Wrote %zd bytes to %s in %.0f ms, %.0f MB/s",
+		written, bufr->filename, secs * 1e3,
+		secs > 0 ? written / secs / (1 << 20) : 0.0);
 }
 
 void findFile(void) {
@@ -188,7 +593,7 @@ void findFile(void) {
 
 	// Create new buffer for the file
 	struct editorBuffer *newBuf = newBuffer();
-	editorOpen(newBuf, (char *)prompt);
+	editorStartLoad(newBuf, (char *)prompt);
 	free(prompt);
 
 	newBuf->next = E_ptr->headbuf;
@@ -206,8 +611,10 @@ void editorInsertFile(struct editorConfig *UNUSED(ed),
 		return;
 	}
 
-	FILE *fp = fopen((char *)filename, "r");
-	if (!fp) {
+	int saved_cy = buf->cy;
+	int lines_inserted =
+		insertFileText(buf, saved_cy, (char *)filename, NULL);
+	if (lines_inserted < 0) {
 		if (errno == ENOENT) {
 			editorSetStatusMessage("File not found: %s", filename);
 		} else {
@@ -218,26 +625,6 @@ void editorInsertFile(struct editorConfig *UNUSED(ed),
 		return;
 	}
 
-	int saved_cy = buf->cy;
-
-	char *line = NULL;
-	size_t linecap = 0;
-	ssize_t linelen;
-	int lines_inserted = 0;
-
-	while ((linelen = emsys_getline(&line, &linecap, fp)) != -1) {
-		while (linelen > 0 && (line[linelen - 1] == '\n' ||
-				       line[linelen - 1] == '\r')) {
-			linelen--;
-		}
-
-		editorInsertRow(buf, saved_cy + lines_inserted, line, linelen);
-		lines_inserted++;
-	}
-
-	free(line);
-	fclose(fp);
-
 	if (lines_inserted > 0) {
 		buf->cy = saved_cy + lines_inserted - 1;
 		buf->cx = buf->row[buf->cy].size;
@@ -1,13 +1,20 @@
 #ifndef FILEIO_H
 #define FILEIO_H
 
+#include <sys/types.h>
+
 struct editorBuffer;
 struct editorConfig;
 
 /* File I/O operations */
-char *editorRowsToString(struct editorBuffer *bufr, int *buflen);
 void editorOpen(struct editorBuffer *bufr, char *filename);
+void editorStartLoad(struct editorBuffer *bufr, char *filename);
+int editorLoadStep(struct editorBuffer *bufr);
+void editorCancelLoad(struct editorBuffer *bufr);
+struct editorBuffer *editorLoadingBuffer(void);
+void editorCheckFile(struct editorBuffer *bufr);
 void editorSave(struct editorBuffer *bufr);
+ssize_t editorWriteRows(int fd, struct editorBuffer *bufr);
 void editorRevert(struct editorConfig *ed, struct editorBuffer *buf);
 void findFile(void);
 void editorInsertFile(struct editorConfig *ed, struct editorBuffer *buf);
@@ -160,6 +160,7 @@ void editorFindCallback(struct editorBuffer *bufr, uint8_t *query, int key) {
 	if (current >= 0 && current < bufr->numrows) {
 		erow *row = &bufr->row[current];
 		uint8_t *match;
+		rowTerminate(row);
 		if (bufr->cx + 1 >= row->size) {
 			match = NULL;
 		} else {
@@ -195,6 +196,7 @@ void editorFindCallback(struct editorBuffer *bufr, uint8_t *query, int key) {
 
 		erow *row = &bufr->row[current];
 		uint8_t *match;
+		rowTerminate(row);
 		if (regex_mode) {
 			match = regexSearch(row->chars, query);
 		} else {
@@ -293,6 +295,7 @@ static int nextOccur(struct editorBuffer *buf, uint8_t *needle, int ocheck) {
 	}
 	while (buf->cy < buf->numrows) {
 		erow *row = &buf->row[buf->cy];
+		rowTerminate(row);
 		uint8_t *match =
 			strstr((char *)&(row->chars[buf->cx]), (char *)needle);
 		if (match) {
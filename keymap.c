@@ -28,6 +28,7 @@
 #include "unused.h"
 #include "terminal.h"
 #include "display.h"
+#include "screen.h"
 #include "keymap.h"
 #include "edit.h"
 #include "region.h"
@@ -56,10 +57,12 @@ void setupCommands(struct editorConfig *ed) {
 		{ "isearch-forward-regexp", editorRegexFindWrapper },
 		{ "kanaya", editorCapitalizeRegion },
 		{ "query-replace", editorQueryReplace },
+		{ "redisplay-stats", editorRedisplayStats },
 		{ "replace-regexp", editorReplaceRegex },
 		{ "replace-string", editorReplaceString },
 		{ "revert", editorRevert },
 		{ "toggle-truncate-lines", editorToggleTruncateLinesWrapper },
+		{ "undo-jump", editorUndoJump },
 		{ "version", editorVersionWrapper },
 		{ "view-register", editorViewRegister },
 		{ "whitespace-cleanup", editorWhitespaceCleanup },
@@ -407,6 +410,18 @@ void executeCommand(int key) {
 	editorProcessKeypress(key);
 }
 
+/* Closes an undo group begun on buf, unless the command killed buf */
+static void endUndoGroup(struct editorBuffer *buf) {
+	for (struct editorBuffer *b = E.headbuf; b != NULL; b = b->next) {
+		if (b == buf) {
+			editorUndoEndGroup(buf);
+			return;
+		}
+	}
+	if (buf == E.minibuf)
+		editorUndoEndGroup(buf);
+}
+
 /* Where the magic happens */
 void editorProcessKeypress(int c) {
 	// Record key if we're recording a macro (but not the macro commands themselves)
@@ -485,6 +500,17 @@ void editorProcessKeypress(int c) {
 	// Store uarg value and reset it after command execution
 	int uarg = E.uarg;
 
+	// Whatever a repeated command changes is undone in one step
+	struct editorBuffer *group = NULL;
+	if (uarg > 1 && c != CTRL('_') && c != REDO
+#ifdef EMSYS_CUA
+	    && c != CTRL('z')
+#endif
+	) {
+		group = E.buf;
+		editorUndoBeginGroup(group);
+	}
+
 	switch (c) {
 	case '\r':
 		editorInsertNewline(E.buf, uarg);
@@ -499,6 +525,7 @@ void editorProcessKeypress(int c) {
 		break;
 	case CTRL('l'):
 		recenter(win);
+		screenInvalidate();
 		break;
 	case QUIT:
 		editorQuit();
@@ -924,6 +951,9 @@ void editorProcessKeypress(int c) {
 		break;
 	}
 
+	if (group != NULL)
+		endUndoGroup(group);
+
 	// Always reset universal argument after command execution
 	E.uarg = 0;
 }
@@ -947,6 +977,9 @@ void editorExecMacro(struct editorMacro *macro) {
 		memcpy(&tmp, &E.macro, sizeof(struct editorMacro));
 		memcpy(&E.macro, macro, sizeof(struct editorMacro));
 	}
+	/* A macro run is undone as one change */
+	struct editorBuffer *group = E.buf;
+	editorUndoBeginGroup(group);
 	E.playback = 0;
 	while (E.playback < E.macro.nkeys) {
 		/* HACK: increment here, so that
@@ -958,6 +991,7 @@ void editorExecMacro(struct editorMacro *macro) {
 		editorProcessKeypress(key);
 	}
 	E.playback = 0;
+	endUndoGroup(group);
 	if (tmp.keys != NULL) {
 		memcpy(&E.macro, &tmp, sizeof(struct editorMacro));
 	}
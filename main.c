@@ -32,6 +32,9 @@
 
 const int page_overlap = 2;
 
+/* Longest a burst of typeahead can hold the screen back, in seconds */
+static const double frame_deadline = 0.05;
+
 struct editorConfig E;
 void setupHandlers(void);
 
@@ -55,6 +58,115 @@ void sigwinchHandler(int UNUSED(sig)) {
 }
 #endif
 
+#ifndef EMSYS_DISABLE_MMAP
+/* Reading a mapped file that has since shrunk; anything else is fatal */
+void sigbusHandler(int UNUSED(sig), siginfo_t *info, void *UNUSED(ctx)) {
+	if (!editorMappedTextFault(info->si_addr))
+		signal(SIGBUS, SIG_DFL);
+}
+#endif
+
+/*** loading ***/
+
+/*
+ * Keys typed while the current buffer is still loading.  Motion keys
+ * run straight away against the rows loaded so far; anything else waits
+ * here, along with every key after it, until the load finishes.
+ */
+static struct editorMacro typeahead;
+static int typeahead_pos;
+
+static int isLoadMotionKey(int c) {
+	switch (c) {
+	case ARROW_LEFT:
+	case ARROW_RIGHT:
+	case ARROW_UP:
+	case ARROW_DOWN:
+	case HOME_KEY:
+	case END_KEY:
+	case PAGE_UP:
+	case PAGE_DOWN:
+	case BEG_OF_FILE:
+	case END_OF_FILE:
+	case FORWARD_WORD:
+	case BACKWARD_WORD:
+	case FORWARD_PARA:
+	case BACKWARD_PARA:
+	case CTRL('a'):
+	case CTRL('b'):
+	case CTRL('e'):
+	case CTRL('f'):
+	case CTRL('l'):
+	case CTRL('n'):
+	case CTRL('p'):
+#ifndef EMSYS_CUA
+	case CTRL('v'):
+#endif
+		return 1;
+	}
+	return 0;
+}
+
+/* Whether editorNextKey has a key it can return without blocking */
+static int keyWaiting(void) {
+	if (typeahead_pos < typeahead.nkeys && E.buf->load == NULL)
+		return 1;
+	return editorInputPending();
+}
+
+/*
+ * Returns the next key to execute, or -1 if the key read was queued or
+ * consumed.  Files still loading are split into rows in steps until
+ * a key arrives.
+ */
+static int editorNextKey(void) {
+	double last = emsys_monotonic_seconds();
+	for (;;) {
+		if (typeahead_pos < typeahead.nkeys && E.buf->load == NULL) {
+			int c = typeahead.keys[typeahead_pos++];
+			if (typeahead_pos == typeahead.nkeys)
+				typeahead_pos = typeahead.nkeys = 0;
+			return c;
+		}
+		struct editorBuffer *loading = editorLoadingBuffer();
+		if (loading == NULL || editorInputPending())
+			break;
+		int more = editorLoadStep(loading);
+		double now = emsys_monotonic_seconds();
+		if (!more || now - last > 0.1) {
+			refreshScreen();
+			last = now;
+		}
+	}
+
+	int c = editorReadKey();
+	if (E.buf->load == NULL)
+		return c;
+	if (c == CTRL('g')) {
+		editorCancelLoad(E.buf);
+		if (typeahead.nkeys > 0) {
+			editorSetStatusMessage(
+				"Loading canceled, %d queued keys discarded",
+				typeahead.nkeys - typeahead_pos);
+		} else {
+			editorSetStatusMessage("Loading canceled");
+		}
+		typeahead_pos = typeahead.nkeys = 0;
+		return -1;
+	}
+	if (typeahead.nkeys == 0 && isLoadMotionKey(c))
+		return c;
+	if (typeahead.nkeys >= typeahead.skeys) {
+		typeahead.skeys = typeahead.skeys ? typeahead.skeys * 2 : 0x10;
+		typeahead.keys = xrealloc(typeahead.keys,
+					  typeahead.skeys * sizeof(int));
+	}
+	typeahead.keys[typeahead.nkeys++] = c;
+	editorSetStatusMessage("Loading %s... (%d keys queued, C-g to cancel)",
+			       E.buf->filename, typeahead.nkeys);
+	return -1;
+}
+
 /*** init ***/
 
 void setupHandlers(void) {
@@ -65,6 +177,18 @@ void setupHandlers(void) {
 	signal(SIGTSTP, editorSuspend);
 }
 
+/* Set before any file is mapped, and left in place from then on */
+static void setupFaultHandler(void) {
+#ifndef EMSYS_DISABLE_MMAP
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = sigbusHandler;
+	sa.sa_flags = SA_SIGINFO;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGBUS, &sa, NULL);
+#endif
+}
+
 void initEditor(void) {
 	E.statusmsg[0] = 0;
 	E.kill = NULL;
@@ -104,6 +228,7 @@ int main(int argc, char *argv[]) {
 
 	enableRawMode();
 	initEditor();
+	setupFaultHandler();
 
 	E.headbuf = newBuffer();
 	E.buf = E.headbuf;
@@ -116,10 +241,13 @@ int main(int argc, char *argv[]) {
 		}
 		for (; i < argc; i++) {
 			struct editorBuffer *newBuf = newBuffer();
-			editorOpen(newBuf, argv[i]);
+			editorStartLoad(newBuf, argv[i]);
 
 			newBuf->next = E.headbuf;
 			if (linum > 0) {
+				while (newBuf->numrows < linum &&
+				       editorLoadStep(newBuf))
+					;
 				if (newBuf->numrows == 0) {
 					newBuf->cy = 0;
 				} else if (linum - 1 >= newBuf->numrows) {
@@ -145,11 +273,23 @@ int main(int argc, char *argv[]) {
 	editorSetStatusMessage("emsys " EMSYS_VERSION " - C-x C-c to quit");
 	setupHandlers();
 
+	double drawn = 0;
 	for (;;) {
-		refreshScreen();
+		editorUndoCheckpoint(E.buf);
+		editorCheckFile(E.buf);
+		/* Keys already waiting, from a paste or key repeat, are run
+		 * before the screen is drawn, though never for so long that
+		 * it looks stuck */
+		double now = emsys_monotonic_seconds();
+		if (!keyWaiting() || now - drawn > frame_deadline) {
+			refreshScreen();
+			drawn = now;
+		}
 
-		int c = editorReadKey();
-		if (c == MACRO_RECORD) {
+		int c = editorNextKey();
+		if (c < 0) {
+			continue;
+		} else if (c == MACRO_RECORD) {
 			if (E.recording) {
 				editorSetStatusMessage(
 					"Already defining keyboard macro");
@@ -144,24 +144,12 @@ void editorPipeCmd(struct editorConfig *ed, struct editorBuffer *bufr) {
 			newBuf->filename = xstrdup("*Shell Output*");
 			newBuf->special_buffer = 1;
 
-			// Use a temporary buffer to build each row
-			size_t rowStart = 0;
-			size_t rowLen = 0;
-			for (size_t i = 0; i < outputLen; i++) {
-				if (pipeOutput[i] == '\n' ||
-				    i == outputLen - 1) {
-					// Found a newline or end of output, insert the row
-					editorInsertRow(
-						newBuf, newBuf->numrows,
-						(char *)&pipeOutput[rowStart],
-						rowLen);
-					rowStart =
-						i + 1; // Start of the next row
-					rowLen = 0;    // Reset row length
-				} else {
-					rowLen++;
-				}
-			}
+			// The final newline ends the last row, not a new one
+			if (pipeOutput[outputLen - 1] == '\n')
+				outputLen--;
+			bufferInsertText(newBuf, 0, 0, pipeOutput, outputLen);
+			newBuf->cx = 0;
+			newBuf->cy = 0;
 
 			// Link the new buffer and update focus
 			if (ed->headbuf == NULL) {
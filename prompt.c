@@ -23,9 +23,7 @@ uint8_t *editorPrompt(struct editorBuffer *bufr, uint8_t *prompt,
 	uint8_t *result = NULL;
 	int history_pos = -1;
 
-	while (E.minibuf->numrows > 0) {
-		editorDelRow(E.minibuf, 0);
-	}
+	editorDelRows(E.minibuf, 0, E.minibuf->numrows);
 	editorInsertRow(E.minibuf, 0, "", 0);
 	E.minibuf->cx = 0;
 	E.minibuf->cy = 0;
@@ -83,9 +81,8 @@ uint8_t *editorPrompt(struct editorBuffer *bufr, uint8_t *prompt,
 				char *last_search =
 					getLastHistory(&E.search_history);
 				if (last_search) {
-					while (E.minibuf->numrows > 0) {
-						editorDelRow(E.minibuf, 0);
-					}
+					editorDelRows(E.minibuf, 0,
+							      E.minibuf->numrows);
 					editorInsertRow(E.minibuf, 0,
 							last_search,
 							strlen(last_search));
@@ -138,10 +135,9 @@ uint8_t *editorPrompt(struct editorBuffer *bufr, uint8_t *prompt,
 					history_str =
 						getHistoryAt(hist, history_pos);
 					if (history_str) {
-						while (E.minibuf->numrows > 0) {
-							editorDelRow(E.minibuf,
-								     0);
-						}
+						editorDelRows(
+							E.minibuf, 0,
+							E.minibuf->numrows);
 						editorInsertRow(
 							E.minibuf, 0,
 							history_str,
@@ -151,9 +147,8 @@ uint8_t *editorPrompt(struct editorBuffer *bufr, uint8_t *prompt,
 						E.minibuf->cy = 0;
 					}
 				} else {
-					while (E.minibuf->numrows > 0) {
-						editorDelRow(E.minibuf, 0);
-					}
+					editorDelRows(E.minibuf, 0,
+							      E.minibuf->numrows);
 					editorInsertRow(E.minibuf, 0, "", 0);
 					E.minibuf->cx = 0;
 					E.minibuf->cy = 0;
@@ -191,9 +186,7 @@ uint8_t *editorPrompt(struct editorBuffer *bufr, uint8_t *prompt,
 					}
 				}
 
-				while (E.minibuf->numrows > 0) {
-					editorDelRow(E.minibuf, 0);
-				}
+				editorDelRows(E.minibuf, 0, E.minibuf->numrows);
 				editorInsertRow(E.minibuf, 0, joined,
 						strlen(joined));
 				E.minibuf->cx = strlen(joined);
@@ -18,11 +18,12 @@ static void addToKillRing(const char *text) {
 	if (!text || strlen(text) == 0)
 		return;
 
-	addHistory(&E.kill_history, text);
+	char *copy = xstrdup(text);
+	addHistory(&E.kill_history, copy);
 	E.kill_ring_pos = -1;
 
 	free(E.kill);
-	E.kill = xstrdup((uint8_t *)text);
+	E.kill = (uint8_t *)copy;
 }
 
 void editorSetMark(void) {
@@ -104,15 +105,13 @@ void editorKillRegion(struct editorConfig *ed, struct editorBuffer *buf) {
 
 	clearRedos(buf);
 
-	struct editorUndo *new = newUndo();
+	struct editorUndo *new = newUndo(buf);
 	new->startx = buf->cx;
 	new->starty = buf->cy;
 	new->endx = buf->markx;
 	new->endy = buf->marky;
-	free(new->data);
 	new->datalen = strlen((char *)ed->kill);
-	new->datasize = new->datalen + 1;
-	new->data = xmalloc(new->datasize);
+	undoReserve(new, new->datalen + 1);
 	/* XXX: have to copy kill to undo in reverse */
 	for (int i = 0; i < new->datalen; i++) {
 		new->data[i] = ed->kill[new->datalen - i - 1];
@@ -123,27 +122,7 @@ void editorKillRegion(struct editorConfig *ed, struct editorBuffer *buf) {
 	new->prev = buf->undo;
 	buf->undo = new;
 
-	struct erow *row = &buf->row[buf->cy];
-	if (buf->cy == buf->marky) {
-		memmove(&row->chars[buf->cx], &row->chars[buf->markx],
-			row->size - buf->markx);
-		row->size -= buf->markx - buf->cx;
-		row->chars[row->size] = 0;
-	} else {
-		for (int i = buf->cy + 1; i < buf->marky; i++) {
-			editorDelRow(buf, buf->cy + 1);
-		}
-		struct erow *last = &buf->row[buf->cy + 1];
-		row->size = buf->cx;
-		row->size += last->size - buf->markx;
-		row->chars = xrealloc(row->chars, row->size);
-		memcpy(&row->chars[buf->cx], &last->chars[buf->markx],
-		       last->size - buf->markx);
-		editorDelRow(buf, buf->cy + 1);
-	}
-
-	buf->dirty = 1;
-	editorUpdateBuffer(buf);
+	bufferDeleteText(buf, buf->cx, buf->cy, buf->markx, buf->marky);
 }
 
 void editorCopyRegion(struct editorConfig *ed, struct editorBuffer *buf) {
@@ -201,23 +180,15 @@ void editorYank(struct editorConfig *ed, struct editorBuffer *buf, int count) {
 	for (int j = 0; j < count; j++) {
 		clearRedos(buf);
 
-		struct editorUndo *new = newUndo();
+		struct editorUndo *new = newUndo(buf);
 		new->startx = buf->cx;
 		new->starty = buf->cy;
-		free(new->data);
 		new->datalen = killLen;
-		new->datasize = new->datalen + 1;
-		new->data = xmalloc(new->datasize);
+		undoReserve(new, new->datalen + 1);
 		emsys_strlcpy(new->data, ed->kill, new->datasize);
 		new->append = 0;
 
-		for (int i = 0; ed->kill[i] != 0; i++) {
-			if (ed->kill[i] == '\n') {
-				editorInsertNewline(buf, 1);
-			} else {
-				editorInsertChar(buf, ed->kill[i], 1);
-			}
-		}
+		bufferInsertText(buf, buf->cx, buf->cy, ed->kill, killLen);
 
 		new->endx = buf->cx;
 		new->endy = buf->cy;
@@ -233,7 +204,6 @@ void editorYank(struct editorConfig *ed, struct editorBuffer *buf, int count) {
 	}
 
 	buf->dirty = 1;
-	editorUpdateBuffer(buf);
 
 	/* Set kill ring position to most recent */
 	ed->kill_ring_pos =
@@ -286,6 +256,7 @@ void editorTransformRegion(struct editorConfig *ed, struct editorBuffer *buf,
 		okill = xmalloc(strlen((char *)ed->kill) + 1);
 		emsys_strlcpy(okill, ed->kill, strlen((char *)ed->kill) + 1);
 	}
+	editorUndoBeginGroup(buf);
 	editorKillRegion(ed, buf);
 
 	uint8_t *input = ed->kill;
@@ -293,7 +264,7 @@ void editorTransformRegion(struct editorConfig *ed, struct editorBuffer *buf,
 	free(ed->kill);
 	ed->kill = transformed;
 	editorYank(ed, buf, 1);
-	buf->undo->paired = 1;
+	editorUndoEndGroup(buf);
 
 	free(ed->kill);
 	ed->kill = okill;
@@ -335,16 +306,13 @@ void editorReplaceRegex(struct editorConfig *ed, struct editorBuffer *buf) {
 
 	/* This is a transformation, so create a delete undo. However, we're not
 	 * actually doing any deletion yet in this case. */
-	struct editorUndo *new = newUndo();
+	struct editorUndo *new = newUndo(buf);
 	new->startx = buf->cx;
 	new->starty = buf->cy;
 	new->endx = buf->markx;
 	new->endy = buf->marky;
 	new->datalen = strlen((char *)ed->kill);
-	if (new->datasize < new->datalen + 1) {
-		new->datasize = new->datalen + 1;
-		new->data = xrealloc(new->data, new->datasize);
-	}
+	undoReserve(new, new->datalen + 1);
 	for (int i = 0; i < new->datalen; i++) {
 		new->data[i] = ed->kill[new->datalen - i - 1];
 	}
@@ -355,15 +323,12 @@ void editorReplaceRegex(struct editorConfig *ed, struct editorBuffer *buf) {
 	buf->undo = new;
 
 	/* Create insert undo */
-	new = newUndo();
+	new = newUndo(buf);
 	new->startx = buf->cx;
 	new->starty = buf->cy;
 	new->endy = buf->marky;
 	new->datalen = buf->undo->datalen;
-	if (new->datasize < new->datalen + 1) {
-		new->datasize = new->datalen + 1;
-		new->data = xrealloc(new->data, new->datasize);
-	}
+	undoReserve(new, new->datalen + 1);
 	new->prev = buf->undo;
 	new->append = 0;
 	new->delete = 0;
@@ -386,6 +351,7 @@ void editorReplaceRegex(struct editorConfig *ed, struct editorBuffer *buf) {
 
 	for (int i = buf->cy; i <= buf->marky; i++) {
 		struct erow *row = &buf->row[i];
+		rowTerminate(row);
 		int regexec_result =
 			regexec(&pattern, (char *)row->chars, 1, matches, 0);
 		int match_idx = (regexec_result == 0) ? matches[0].rm_so : -1;
@@ -428,10 +394,8 @@ void editorReplaceRegex(struct editorConfig *ed, struct editorBuffer *buf) {
 		row = &buf->row[i];
 		int extra = replen - match_length;
 		if (extra > 0) {
-			row->chars =
-				xrealloc(row->chars, row->size + 1 + extra);
-			new->datasize += extra;
-			new->data = xrealloc(new->data, new->datasize);
+			rowRealloc(buf, row, row->size + 1 + extra);
+			undoReserve(new, new->datasize + extra);
 		}
 		memmove(&row->chars[match_idx + replen],
 			&row->chars[match_idx + match_length],
@@ -464,7 +428,7 @@ void editorReplaceRegex(struct editorConfig *ed, struct editorBuffer *buf) {
 	buf->cx = new->endx;
 	buf->cy = new->endy;
 
-	editorUpdateBuffer(buf);
+	invalidateRows(buf, new->starty, new->endy);
 	regfree(&pattern);
 	free(regex);
 	free(repl);
@@ -529,15 +493,13 @@ void editorStringRectangle(struct editorConfig *ed, struct editorBuffer *buf) {
 	clearRedos(buf);
 
 	/* This is mostly a normal kill-region type undo. */
-	struct editorUndo *new = newUndo();
+	struct editorUndo *new = newUndo(buf);
 	new->startx = buf->cx;
 	new->starty = buf->cy;
 	new->endx = buf->markx;
 	new->endy = buf->marky;
-	free(new->data);
 	new->datalen = strlen((char *)ed->kill);
-	new->datasize = new->datalen + 1;
-	new->data = xmalloc(new->datasize);
+	undoReserve(new, new->datalen + 1);
 	for (int i = 0; i < new->datalen; i++) {
 		new->data[i] = ed->kill[new->datalen - i - 1];
 	}
@@ -548,21 +510,19 @@ void editorStringRectangle(struct editorConfig *ed, struct editorBuffer *buf) {
 	buf->undo = new;
 
 	/* Undo for a yank region */
-	new = newUndo();
+	new = newUndo(buf);
 	new->prev = buf->undo;
 	new->startx = topx;
 	new->starty = topy;
 	new->endx = botx + extra;
 	new->endy = boty;
-	free(new->data);
 	new->datalen = 0;
 	if (extra > 0) {
-		new->datasize = strlen((char *)ed->kill) +
-				(extra * ((boty - topy) + 1)) + 1;
+		undoReserve(new, strlen((char *)ed->kill) +
+				    (extra * ((boty - topy) + 1)) + 1);
 	} else {
-		new->datasize = strlen((char *)ed->kill);
+		undoReserve(new, strlen((char *)ed->kill));
 	}
-	new->data = xmalloc(new->datasize);
 	new->data[0] = 0;
 	new->append = 0;
 	new->paired = 1;
@@ -578,15 +538,14 @@ void editorStringRectangle(struct editorConfig *ed, struct editorBuffer *buf) {
 	/* First, topy */
 	struct erow *row = &buf->row[topy];
 	if (row->size < botx) {
-		row->chars = xrealloc(row->chars, botx + 1);
+		rowRealloc(buf, row, botx + 1);
 		memset(&row->chars[row->size], ' ', botx - row->size);
 		row->size = botx;
 		/* Better safe than sorry */
-		new->datasize += row->size + 1;
-		new->data = xrealloc(new->data, new->datasize);
+		undoReserve(new, new->datasize + row->size + 1);
 	}
 	if (extra > 0) {
-		row->chars = xrealloc(row->chars, row->size + 1 + extra);
+		rowRealloc(buf, row, row->size + 1 + extra);
 	}
 	memcpy(&row->chars[topx + slen], &row->chars[botx], row->size - botx);
 	memcpy(&row->chars[topx], string, slen);
@@ -604,15 +563,13 @@ void editorStringRectangle(struct editorConfig *ed, struct editorBuffer *buf) {
 		/* Next, middle lines */
 		row = &buf->row[i];
 		if (row->size < botx) {
-			row->chars = xrealloc(row->chars, botx + 1);
+			rowRealloc(buf, row, botx + 1);
 			memset(&row->chars[row->size], ' ', botx - row->size);
 			row->size = botx;
-			new->datasize += row->size + 1;
-			new->data = xrealloc(new->data, new->datasize);
+			undoReserve(new, new->datasize + row->size + 1);
 		}
 		if (extra > 0) {
-			row->chars =
-				xrealloc(row->chars, row->size + 1 + extra);
+			rowRealloc(buf, row, row->size + 1 + extra);
 		}
 		memcpy(&row->chars[topx + slen], &row->chars[botx],
 		       row->size - botx);
@@ -628,15 +585,13 @@ void editorStringRectangle(struct editorConfig *ed, struct editorBuffer *buf) {
 		emsys_strlcat((char *)new->data, "\n", new->datasize);
 		row = &buf->row[boty];
 		if (row->size < botx) {
-			row->chars = xrealloc(row->chars, botx + 1);
+			rowRealloc(buf, row, botx + 1);
 			memset(&row->chars[row->size], ' ', botx - row->size);
 			row->size = botx;
-			new->datasize += row->size + 1;
-			new->data = xrealloc(new->data, new->datasize);
+			undoReserve(new, new->datasize + row->size + 1);
 		}
 		if (extra > 0) {
-			row->chars =
-				xrealloc(row->chars, row->size + 1 + extra);
+			rowRealloc(buf, row, row->size + 1 + extra);
 		}
 		memcpy(&row->chars[topx + slen], &row->chars[botx],
 		       row->size - botx);
@@ -648,7 +603,7 @@ void editorStringRectangle(struct editorConfig *ed, struct editorBuffer *buf) {
 	new->datalen = strlen((char *)new->data);
 
 	buf->dirty = 1;
-	editorUpdateBuffer(buf);
+	invalidateRows(buf, topy, boty);
 	ed->kill = okill;
 }
 
@@ -774,15 +729,13 @@ void editorKillRectangle(struct editorConfig *ed, struct editorBuffer *buf) {
 
 	ed->rectKill = xcalloc((ed->rx * ed->ry) + 1, 1);
 
-	struct editorUndo *new = newUndo();
+	struct editorUndo *new = newUndo(buf);
 	new->startx = buf->cx;
 	new->starty = buf->cy;
 	new->endx = buf->markx;
 	new->endy = buf->marky;
-	free(new->data);
 	new->datalen = strlen((char *)ed->kill);
-	new->datasize = new->datalen + 1;
-	new->data = xmalloc(new->datasize);
+	undoReserve(new, new->datalen + 1);
 	for (int i = 0; i < new->datalen; i++) {
 		new->data[i] = ed->kill[new->datalen - i - 1];
 	}
@@ -793,16 +746,14 @@ void editorKillRectangle(struct editorConfig *ed, struct editorBuffer *buf) {
 	buf->undo = new;
 
 	/* This is technically a transformation, so we need paired undos. */
-	new = newUndo();
+	new = newUndo(buf);
 	new->prev = buf->undo;
 	new->startx = topx;
 	new->starty = topy;
 	new->endx = botx - ed->rx;
 	new->endy = boty;
-	free(new->data);
 	new->datalen = strlen((char *)ed->kill) - (ed->rx * ed->ry);
-	new->datasize = 1 + new->datalen;
-	new->data = xmalloc(new->datasize);
+	undoReserve(new, 1 + new->datalen);
 	new->data[0] = 0;
 	new->append = 0;
 	new->paired = 1;
@@ -811,6 +762,7 @@ void editorKillRectangle(struct editorConfig *ed, struct editorBuffer *buf) {
 	/* First, topy */
 	int idx = 0;
 	struct erow *row = &buf->row[topy + idx];
+	rowTerminate(row);
 	if (row->size < botx) {
 		memset(&ed->rectKill[idx * ed->rx], ' ', ed->rx);
 		if (row->size > botx - ed->rx) {
@@ -829,7 +781,7 @@ void editorKillRectangle(struct editorConfig *ed, struct editorBuffer *buf) {
 	} else {
 		strncpy((char *)&ed->rectKill[idx * ed->rx],
 			(char *)&row->chars[botx - ed->rx], ed->rx);
-		memcpy(&row->chars[topx], &row->chars[botx], row->size - botx);
+		memmove(&row->chars[topx], &row->chars[botx], row->size - botx);
 		row->size -= ed->rx;
 		row->chars[row->size] = 0;
 		if (boty != topy) {
@@ -843,6 +795,7 @@ void editorKillRectangle(struct editorConfig *ed, struct editorBuffer *buf) {
 		/* Middle lines */
 		emsys_strlcat((char *)new->data, "\n", new->datasize);
 		row = &buf->row[topy + idx];
+		rowTerminate(row);
 
 		if (row->size < botx) {
 			memset(&ed->rectKill[idx * ed->rx], ' ', ed->rx);
@@ -856,8 +809,8 @@ void editorKillRectangle(struct editorConfig *ed, struct editorBuffer *buf) {
 		} else {
 			strncpy((char *)&ed->rectKill[idx * ed->rx],
 				(char *)&row->chars[botx - ed->rx], ed->rx);
-			memcpy(&row->chars[topx], &row->chars[botx],
-			       row->size - botx);
+			memmove(&row->chars[topx], &row->chars[botx],
+				row->size - botx);
 			row->size -= ed->rx;
 			row->chars[row->size] = 0;
 		}
@@ -871,6 +824,7 @@ void editorKillRectangle(struct editorConfig *ed, struct editorBuffer *buf) {
 	if (topy != boty) {
 		emsys_strlcat((char *)new->data, "\n", new->datasize);
 		row = &buf->row[topy + idx];
+		rowTerminate(row);
 
 		if (row->size < botx) {
 			memset(&ed->rectKill[idx * ed->rx], ' ', ed->rx);
@@ -884,8 +838,8 @@ void editorKillRectangle(struct editorConfig *ed, struct editorBuffer *buf) {
 		} else {
 			strncpy((char *)&ed->rectKill[idx * ed->rx],
 				(char *)&row->chars[botx - ed->rx], ed->rx);
-			memcpy(&row->chars[topx], &row->chars[botx],
-			       row->size - botx);
+			memmove(&row->chars[topx], &row->chars[botx],
+				row->size - botx);
 			row->size -= ed->rx;
 			row->chars[row->size] = 0;
 		}
@@ -895,7 +849,7 @@ void editorKillRectangle(struct editorConfig *ed, struct editorBuffer *buf) {
 	new->datalen = strlen((char *)new->data);
 
 	buf->dirty = 1;
-	editorUpdateBuffer(buf);
+	invalidateRows(buf, topy, boty);
 	ed->kill = okill;
 }
 
@@ -926,15 +880,12 @@ void editorYankRectangle(struct editorConfig *ed, struct editorBuffer *buf) {
 		extralines++;
 	}
 	if (extralines) {
-		struct editorUndo *new = newUndo();
+		struct editorUndo *new = newUndo(buf);
 		new->starty = buf->numrows - extralines - 1;
 		new->startx = buf->row[new->starty].size;
 		new->endx = 0;
 		new->endy = buf->numrows - 1;
-		if (extralines >= new->datasize) {
-			new->datasize = extralines + 1;
-			new->data = xrealloc(new->data, new->datasize);
-		}
+		undoReserve(new, extralines + 1);
 		memset(new->data, '\n', extralines);
 		new->data[extralines] = 0;
 		new->datalen = strlen((char *)new->data);
@@ -947,19 +898,17 @@ void editorYankRectangle(struct editorConfig *ed, struct editorBuffer *buf) {
 	editorCopyRegion(ed, buf);
 	clearRedos(buf);
 
-	struct editorUndo *new = newUndo();
+	struct editorUndo *new = newUndo(buf);
 	new->startx = buf->cx;
 	new->starty = buf->cy;
 	new->endx = buf->markx;
 	new->endy = buf->marky;
-	free(new->data);
 	if (ed->kill == NULL) {
 		new->datalen = 0;
 	} else {
 		new->datalen = strlen((char *)ed->kill);
 	}
-	new->datasize = new->datalen + 1;
-	new->data = xmalloc(new->datasize);
+	undoReserve(new, new->datalen + 1);
 	if (ed->kill == NULL) {
 		new->data[0] = 0;
 	} else {
@@ -975,21 +924,19 @@ void editorYankRectangle(struct editorConfig *ed, struct editorBuffer *buf) {
 	buf->undo = new;
 
 	/* Transformation (insert) undo */
-	new = newUndo();
+	new = newUndo(buf);
 	new->prev = buf->undo;
 	new->startx = topx;
 	new->starty = topy;
 	new->endx = botx + ed->rx;
 	new->endy = boty;
-	free(new->data);
 	new->datalen = 0;
 	if (ed->rx > 0) {
-		new->datasize = strlen((char *)ed->kill) +
-				(ed->rx * ((boty - topy) + 1)) + 1;
+		undoReserve(new, strlen((char *)ed->kill) +
+				    (ed->rx * ((boty - topy) + 1)) + 1);
 	} else {
-		new->datasize = strlen((char *)ed->kill);
+		undoReserve(new, strlen((char *)ed->kill));
 	}
-	new->data = xmalloc(new->datasize);
 	new->data[0] = 0;
 	new->append = 0;
 	new->paired = 1;
@@ -1000,14 +947,13 @@ void editorYankRectangle(struct editorConfig *ed, struct editorBuffer *buf) {
 	struct erow *row = &buf->row[topy];
 	strncpy(string, (char *)&ed->rectKill[idx * ed->rx], ed->rx);
 	if (row->size < botx) {
-		row->chars = xrealloc(row->chars, botx + 1);
+		rowRealloc(buf, row, botx + 1);
 		memset(&row->chars[row->size], ' ', botx - row->size);
 		row->size = botx;
-		new->datasize += row->size + 1;
-		new->data = xrealloc(new->data, new->datasize);
+		undoReserve(new, new->datasize + row->size + 1);
 	}
 	if (ed->rx > 0) {
-		row->chars = xrealloc(row->chars, row->size + 1 + ed->rx);
+		rowRealloc(buf, row, row->size + 1 + ed->rx);
 	}
 	memcpy(&row->chars[topx + ed->rx], &row->chars[botx], row->size - botx);
 	memcpy(&row->chars[topx], string, ed->rx);
@@ -1027,15 +973,13 @@ void editorYankRectangle(struct editorConfig *ed, struct editorBuffer *buf) {
 		row = &buf->row[topy + idx];
 		strncpy(string, (char *)&ed->rectKill[idx * ed->rx], ed->rx);
 		if (row->size < botx) {
-			row->chars = xrealloc(row->chars, botx + 1);
+			rowRealloc(buf, row, botx + 1);
 			memset(&row->chars[row->size], ' ', botx - row->size);
 			row->size = botx;
-			new->datasize += row->size + 1;
-			new->data = xrealloc(new->data, new->datasize);
+			undoReserve(new, new->datasize + row->size + 1);
 		}
 		if (ed->rx > 0) {
-			row->chars =
-				xrealloc(row->chars, row->size + 1 + ed->rx);
+			rowRealloc(buf, row, row->size + 1 + ed->rx);
 		}
 		memcpy(&row->chars[topx + ed->rx], &row->chars[botx],
 		       row->size - botx);
@@ -1053,15 +997,13 @@ void editorYankRectangle(struct editorConfig *ed, struct editorBuffer *buf) {
 		strncpy(string, (char *)&ed->rectKill[idx * ed->rx], ed->rx);
 		row = &buf->row[boty];
 		if (row->size < botx) {
-			row->chars = xrealloc(row->chars, botx + 1);
+			rowRealloc(buf, row, botx + 1);
 			memset(&row->chars[row->size], ' ', botx - row->size);
 			row->size = botx;
-			new->datasize += row->size + 1;
-			new->data = xrealloc(new->data, new->datasize);
+			undoReserve(new, new->datasize + row->size + 1);
 		}
 		if (ed->rx > 0) {
-			row->chars =
-				xrealloc(row->chars, row->size + 1 + ed->rx);
+			rowRealloc(buf, row, row->size + 1 + ed->rx);
 		}
 		memcpy(&row->chars[topx + ed->rx], &row->chars[botx],
 		       row->size - botx);
@@ -1073,6 +1015,6 @@ void editorYankRectangle(struct editorConfig *ed, struct editorBuffer *buf) {
 	new->datalen = strlen((char *)new->data);
 
 	buf->dirty = 1;
-	editorUpdateBuffer(buf);
+	invalidateRows(buf, topy, boty);
 	ed->kill = okill;
 }
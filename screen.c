@@ -0,0 +1,653 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "emsys.h"
+#include "display.h"
+#include "screen.h"
+#include "unicode.h"
+#include "unused.h"
+#include "util.h"
+
+extern struct editorConfig E;
+
+/*
+ * A frame is still drawn into an abuf as a stream of text and escape
+ * sequences.  Rather than writing that out whole, it is played onto a
+ * grid of cells and compared with the grid of what the terminal already
+ * shows, and only the cells that differ are sent.  Rows or cells the
+ * terminal already shows elsewhere, as after scrolling or typing
+ * partway along a line, are moved into place by the terminal itself.
+ * What is sent goes out in one write, wrapped in a synchronized update
+ * if configured, so the terminal never shows half a frame.
+ */
+
+/* Bytes a cell keeps: a character and a combining mark or two */
+#define CELL_BYTES 11
+/* Set in a cell's attr for reverse video; the rest is the SGR colour */
+#define ATTR_REVERSE 0x80
+/* Unchanged cells worth rewriting rather than moving the cursor over */
+#define SKIP_CELLS 8
+/* Bytes to set a scroll region, insert or delete lines and reset it */
+#define SHIFT_ROWS_COST 20
+/* Most blocks of rows moved in one frame */
+#define MAX_ROW_SHIFTS 8
+/* Bytes to move the cursor and insert or delete characters */
+#define SHIFT_CELLS_COST 10
+/* Furthest cells are looked for along a row */
+#define MAX_CELL_SHIFT 8
+
+struct screenCell {
+	uint8_t bytes[CELL_BYTES];
+	uint8_t len; /* 0 for the right half of a wide character */
+	uint8_t width;
+	uint8_t attr;
+};
+
+static struct {
+	struct screenCell *shown; /* what the terminal shows */
+	struct screenCell *next; /* the frame being played */
+	uint32_t *hash; /* of each row of shown, then of next */
+	int *cost; /* running totals of bytes to draw rows, two ways */
+	int rows;
+	int cols;
+	int valid; /* shown matches the terminal */
+	int busy;
+	struct abuf out; /* kept between frames */
+	/* Totals over every frame written, for redisplay-stats */
+	unsigned long frames;
+	unsigned long long bytes;
+	double secs;
+	int last_bytes;
+	double last_secs;
+} screen;
+
+static const struct screenCell blank = { " ", 1, 1, 0 };
+
+/* Unused bytes are kept zero, so cells compare whole */
+static int cellEqual(const struct screenCell *a, const struct screenCell *b) {
+	return memcmp(a, b, sizeof(*a)) == 0;
+}
+
+static int cellBlank(const struct screenCell *cell) {
+	return cellEqual(cell, &blank);
+}
+
+static void clearCells(struct screenCell *cell, int n) {
+	for (int i = 0; i < n; i++)
+		cell[i] = blank;
+}
+
+/* Writes a character at x the way a terminal does, wiping any wide
+ * character it lands on half of */
+static void putCell(struct screenCell *row, int x,
+		    const struct screenCell *cell) {
+	if (row[x].len == 0 && x > 0)
+		row[x - 1] = blank;
+	if (row[x].width == 2 && x + 1 < screen.cols)
+		row[x + 1] = blank;
+	row[x] = *cell;
+	if (cell->width == 2) {
+		if (x + 2 < screen.cols && row[x + 1].width == 2)
+			row[x + 2] = blank;
+		row[x + 1] = *cell;
+		row[x + 1].len = 0;
+		row[x + 1].width = 0;
+	}
+}
+
+static void setAttr(uint8_t *attr, int param) {
+	if (param == 0)
+		*attr = 0;
+	else if (param == 7)
+		*attr |= ATTR_REVERSE;
+	else if (param == 27)
+		*attr &= ~ATTR_REVERSE;
+	else if ((30 <= param && param <= 37) || (90 <= param && param <= 97))
+		*attr = (*attr & ATTR_REVERSE) | param;
+	else if (param == 39)
+		*attr &= ATTR_REVERSE;
+}
+
+/*
+ * Plays a frame onto the next grid.  Only what the drawing code emits
+ * is understood: cursor addressing, erasing to the end of the line or
+ * screen, SGR, CR and LF.  Returns where the frame leaves the cursor.
+ */
+static void playFrame(const char *frame, int len, int *cy, int *cx) {
+	const uint8_t *s = (const uint8_t *)frame;
+	int rows = screen.rows;
+	int cols = screen.cols;
+	int y = 0;
+	int x = 0;
+	uint8_t attr = 0;
+
+	clearCells(screen.next, rows * cols);
+	int i = 0;
+	while (i < len) {
+		uint8_t c = s[i];
+		struct screenCell *row = &screen.next[y * cols];
+
+		if (c == '\x1b') {
+			if (++i >= len || s[i] != '[')
+				continue;
+			int private = ++i < len && s[i] == '?';
+			if (private)
+				i++;
+			int params[4] = { 0 };
+			int nparams = 1;
+			while (i < len &&
+			       (s[i] == ';' || ('0' <= s[i] && s[i] <= '9'))) {
+				if (s[i] == ';') {
+					if (nparams < 4)
+						params[nparams] = 0;
+					nparams++;
+				} else if (nparams <= 4) {
+					int *p = &params[nparams - 1];
+					*p = *p * 10 + s[i] - '0';
+				}
+				i++;
+			}
+			if (i >= len)
+				break;
+			uint8_t final = s[i++];
+			if (private)
+				continue;
+			switch (final) {
+			case 'H':
+				y = params[0] > 0 ? params[0] - 1 : 0;
+				x = params[1] > 0 ? params[1] - 1 : 0;
+				if (y >= rows)
+					y = rows - 1;
+				if (x >= cols)
+					x = cols - 1;
+				break;
+			case 'K':
+				if (x < cols)
+					clearCells(&row[x], cols - x);
+				break;
+			case 'J':
+				if (x < cols)
+					clearCells(&row[x], cols - x);
+				clearCells(&screen.next[(y + 1) * cols],
+					   (rows - y - 1) * cols);
+				break;
+			case 'm':
+				for (int p = 0; p < nparams && p < 4; p++)
+					setAttr(&attr, params[p]);
+				break;
+			}
+			continue;
+		}
+		if (c == '\r') {
+			x = 0;
+			i++;
+			continue;
+		}
+		if (c == '\n') {
+			if (y < rows - 1)
+				y++;
+			i++;
+			continue;
+		}
+		if (c < 0x20) {
+			i++;
+			continue;
+		}
+
+		int n = utf8_nBytes(c);
+		if (n > len - i)
+			n = len - i;
+		int width = c < 0x80 ? 1 : charInStringWidth((uint8_t *)s, i);
+		if (width <= 0 || width > 2) {
+			/* Combining: the terminal puts it on the cell before */
+			struct screenCell *prev = x > 0 ? &row[x - 1] : NULL;
+			if (prev != NULL && prev->len == 0)
+				prev--;
+			if (prev != NULL && prev->len + n <= CELL_BYTES) {
+				memcpy(&prev->bytes[prev->len], &s[i], n);
+				prev->len += n;
+			}
+			i += n;
+			continue;
+		}
+		if (x + width > cols) {
+			/* Wrapped on to the next line */
+			x = 0;
+			if (y < rows - 1)
+				y++;
+			row = &screen.next[y * cols];
+		}
+		struct screenCell cell = { { 0 }, n, width, attr };
+		memcpy(cell.bytes, &s[i], n);
+		putCell(row, x, &cell);
+		x += width;
+		i += n;
+	}
+	*cy = y;
+	*cx = x < cols ? x : cols - 1;
+}
+
+static void emitAttr(struct abuf *ab, uint8_t attr) {
+	char seq[16];
+	int n = snprintf(seq, sizeof(seq), CSI "0%s",
+			 attr & ATTR_REVERSE ? ";7" : "");
+	if (attr & ~ATTR_REVERSE)
+		n += snprintf(&seq[n], sizeof(seq) - n, ";%d",
+			      attr & ~ATTR_REVERSE);
+	seq[n++] = 'm';
+	abAppend(ab, seq, n);
+}
+
+/* Moves the cursor from (cury, curx), if that is known, to (y, x) */
+static void emitMove(struct abuf *ab, int cury, int curx, int y, int x) {
+	char seq[32];
+	int n;
+	if (cury == y && curx == x)
+		return;
+	if (cury >= 0 && cury + 1 == y && x == 0)
+		n = snprintf(seq, sizeof(seq), CRLF);
+	else if (cury == y && curx < x)
+		n = snprintf(seq, sizeof(seq), CSI "%dC", x - curx);
+	else
+		n = snprintf(seq, sizeof(seq), CSI "%d;%dH", y + 1, x + 1);
+	abAppend(ab, seq, n);
+}
+
+/* Bytes it takes to turn row old, or a blank row if NULL, into row new,
+ * roughly: the cells that differ and a cursor move to each run of them */
+static int rowCost(const struct screenCell *old,
+		   const struct screenCell *new) {
+	int n = 0;
+	int run = 0;
+	for (int x = 0; x < screen.cols; x++) {
+		if (cellEqual(old != NULL ? &old[x] : &blank, &new[x])) {
+			run = 0;
+			continue;
+		}
+		if (!run)
+			n += 4;
+		run = 1;
+		n += new[x].len;
+	}
+	return n;
+}
+
+/* FNV-1a over the cells of row, or of a blank row if NULL */
+static uint32_t rowHash(const struct screenCell *row) {
+	uint32_t h = 2166136261u;
+	for (int x = 0; x < screen.cols; x++) {
+		const uint8_t *p =
+			(const uint8_t *)(row != NULL ? &row[x] : &blank);
+		for (size_t i = 0; i < sizeof(*row); i++)
+			h = (h ^ p[i]) * 16777619u;
+	}
+	return h;
+}
+
+/* Moves rows top..bottom by d, down if d is positive, leaving blank
+ * rows behind them */
+static void emitRowShift(struct abuf *ab, int top, int bottom, int d) {
+	char seq[48];
+	int n = 0;
+	/* Lines only shift as far down as the bottom of the region */
+	int region = bottom < screen.rows - 1;
+	if (region)
+		n += snprintf(&seq[n], sizeof(seq) - n, CSI "%d;%dr", top + 1,
+			      bottom + 1);
+	n += snprintf(&seq[n], sizeof(seq) - n, CSI "%dH", top + 1);
+	n += snprintf(&seq[n], sizeof(seq) - n, CSI "%d%c", d > 0 ? d : -d,
+		      d > 0 ? 'L' : 'M');
+	if (region)
+		n += snprintf(&seq[n], sizeof(seq) - n, CSI "r");
+	abAppend(ab, seq, n);
+
+	int cols = screen.cols;
+	int keep = (bottom - top + 1 - (d > 0 ? d : -d)) * cols;
+	if (d > 0) {
+		memmove(&screen.shown[(top + d) * cols],
+			&screen.shown[top * cols],
+			keep * sizeof(*screen.shown));
+		clearCells(&screen.shown[top * cols], d * cols);
+	} else {
+		memmove(&screen.shown[top * cols],
+			&screen.shown[(top - d) * cols],
+			keep * sizeof(*screen.shown));
+		clearCells(&screen.shown[(bottom + d + 1) * cols], -d * cols);
+	}
+}
+
+/*
+ * Looks for blocks of rows in the frame that the terminal shows higher
+ * up or lower down, and shifts them there with insert or delete line
+ * inside a scroll region, so scrolling or opening a line sends a few
+ * bytes rather than the whole window.  A block is moved only when that
+ * saves more than it costs, counting the rows it pushes aside.  Rows
+ * are matched on their hashes alone: diffRow still fixes up whatever
+ * differs afterwards.
+ */
+static void shiftRows(struct abuf *ab) {
+	int rows = screen.rows;
+	int cols = screen.cols;
+	uint32_t *old = screen.hash;
+	uint32_t *new = &screen.hash[rows];
+	/* Bytes to draw rows before y over what is shown, and from blank */
+	int *redraw = screen.cost;
+	int *fresh = &screen.cost[rows + 1];
+
+	fresh[0] = 0;
+	for (int y = 0; y < rows; y++) {
+		old[y] = rowHash(&screen.shown[y * cols]);
+		new[y] = rowHash(&screen.next[y * cols]);
+		fresh[y + 1] = fresh[y] + rowCost(NULL,
+						  &screen.next[y * cols]);
+	}
+	uint32_t blank_hash = rowHash(NULL);
+
+	for (int pass = 0; pass < MAX_ROW_SHIFTS; pass++) {
+		redraw[0] = 0;
+		for (int y = 0; y < rows; y++) {
+			redraw[y + 1] = redraw[y];
+			if (old[y] != new[y])
+				redraw[y + 1] +=
+					rowCost(&screen.shown[y * cols],
+						&screen.next[y * cols]);
+		}
+
+		int best = SHIFT_ROWS_COST;
+		int top = 0;
+		int bottom = 0;
+		int shift = 0;
+		for (int d = 1 - rows; d < rows; d++) {
+			if (d == 0)
+				continue;
+			/* Row y of the frame shows what row y - d does now */
+			int y = d > 0 ? d : 0;
+			int end = d > 0 ? rows : rows + d;
+			while (y < end) {
+				if (new[y] != old[y - d]) {
+					y++;
+					continue;
+				}
+				int start = y;
+				while (y < end && new[y] == old[y - d])
+					y++;
+				/* The region takes in the rows the block
+				 * moves over, which are left blank */
+				int t = d > 0 ? start - d : start;
+				int b = d > 0 ? y - 1 : y - 1 - d;
+				int bare = d > 0 ? fresh[start] - fresh[t] :
+						   fresh[b + 1] - fresh[y];
+				int gain = redraw[b + 1] - redraw[t] - bare;
+				if (gain > best) {
+					best = gain;
+					top = t;
+					bottom = b;
+					shift = d;
+				}
+			}
+		}
+		if (shift == 0)
+			break;
+		emitRowShift(ab, top, bottom, shift);
+
+		/* The hashes move with the rows */
+		int m = shift > 0 ? shift : -shift;
+		int first = shift > 0 ? top : bottom - m + 1;
+		if (shift > 0)
+			memmove(&old[top + m], &old[top],
+				(bottom - top + 1 - m) * sizeof(*old));
+		else
+			memmove(&old[top], &old[top + m],
+				(bottom - top + 1 - m) * sizeof(*old));
+		for (int y = first; y < first + m; y++)
+			old[y] = blank_hash;
+	}
+}
+
+/*
+ * Looks for the cells of a row having moved along it, as when a
+ * character is typed or deleted partway along a line, and shifts them
+ * with insert or delete character rather than rewriting the rest of the
+ * line.  A shift that would split a wide character is left alone.
+ */
+static void shiftCells(struct abuf *ab, int y, int *cury, int *curx,
+		       uint8_t *attr) {
+	struct screenCell *old = &screen.shown[y * screen.cols];
+	struct screenCell *new = &screen.next[y * screen.cols];
+	int cols = screen.cols;
+
+	int p = 0;
+	while (p < cols && cellEqual(&old[p], &new[p]))
+		p++;
+	if (p == cols || old[p].len == 0 || new[p].len == 0)
+		return;
+	int end = cols;
+	while (end > p && cellBlank(&new[end - 1]))
+		end--;
+
+	int best = SHIFT_CELLS_COST;
+	int shift = 0;
+	for (int k = -MAX_CELL_SHIFT; k <= MAX_CELL_SHIFT; k++) {
+		int m = k > 0 ? k : -k;
+		if (k == 0 || p + m >= cols)
+			continue;
+		if (k > 0 ? old[cols - k].len == 0 : old[p + m].len == 0)
+			continue;
+		int gain = 0;
+		for (int x = p; x < end; x++) {
+			const struct screenCell *moved;
+			if (k > 0)
+				moved = x < p + k ? &blank : &old[x - k];
+			else
+				moved = x < cols - m ? &old[x + m] : &blank;
+			int before = cellEqual(&old[x], &new[x]);
+			int after = cellEqual(moved, &new[x]);
+			gain += (after - before) * new[x].len;
+		}
+		if (gain > best) {
+			best = gain;
+			shift = k;
+		}
+	}
+	if (shift == 0)
+		return;
+
+	emitMove(ab, *cury, *curx, y, p);
+	if (*attr != 0) {
+		/* Inserted and freed cells take the current colours */
+		abAppend(ab, CSI "0m", 4);
+		*attr = 0;
+	}
+	char seq[16];
+	int m = shift > 0 ? shift : -shift;
+	int n = snprintf(seq, sizeof(seq), CSI "%d%c", m,
+			 shift > 0 ? '@' : 'P');
+	abAppend(ab, seq, n);
+	*cury = y;
+	*curx = p;
+
+	if (shift > 0) {
+		memmove(&old[p + m], &old[p], (cols - p - m) * sizeof(*old));
+		clearCells(&old[p], m);
+	} else {
+		memmove(&old[p], &old[p + m], (cols - p - m) * sizeof(*old));
+		clearCells(&old[cols - m], m);
+	}
+}
+
+/*
+ * Appends what it takes to turn row y of the terminal from shown into
+ * next.  Runs of changed cells are rewritten, the cursor jumps over
+ * long unchanged stretches, and blanks up to the end of the line are
+ * erased rather than written out.
+ */
+static void diffRow(struct abuf *ab, int y, int *cury, int *curx,
+		    uint8_t *attr) {
+	struct screenCell *old = &screen.shown[y * screen.cols];
+	struct screenCell *new = &screen.next[y * screen.cols];
+	int cols = screen.cols;
+
+	shiftCells(ab, y, cury, curx, attr);
+
+	int end = cols;
+	while (end > 0 && cellBlank(&new[end - 1]))
+		end--;
+
+	int x = 0;
+	while (x < end) {
+		if (cellEqual(&old[x], &new[x])) {
+			x++;
+			continue;
+		}
+		if (new[x].len == 0)
+			x--;
+		emitMove(ab, *cury, *curx, y, x);
+		*cury = y;
+		for (;;) {
+			if (new[x].len > 0) {
+				if (new[x].attr != *attr) {
+					emitAttr(ab, new[x].attr);
+					*attr = new[x].attr;
+				}
+				abAppend(ab, (char *)new[x].bytes, new[x].len);
+				*curx = x + new[x].width;
+			}
+			x++;
+			int same = 0;
+			while (x + same < end && same < SKIP_CELLS &&
+			       cellEqual(&old[x + same], &new[x + same]))
+				same++;
+			if (x + same >= end || same == SKIP_CELLS)
+				break;
+		}
+	}
+
+	int stale = end;
+	while (stale < cols && cellBlank(&old[stale]))
+		stale++;
+	if (stale < cols) {
+		emitMove(ab, *cury, *curx, y, end);
+		if (*attr != 0) {
+			abAppend(ab, CSI "0m", 4);
+			*attr = 0;
+		}
+		abAppend(ab, CSI "K", 3);
+		*cury = y;
+		*curx = end;
+	}
+}
+
+void screenInvalidate(void) {
+	screen.valid = 0;
+}
+
+/*
+ * Writes all of a frame, going round again after a partial write or an
+ * interrupt.  Returns -1 if the terminal stopped taking it.
+ */
+static int writeFrame(const char *b, int len) {
+	while (len > 0) {
+		ssize_t n = write(STDOUT_FILENO, b, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				struct pollfd pfd = { STDOUT_FILENO, POLLOUT,
+						      0 };
+				poll(&pfd, 1, -1);
+				continue;
+			}
+			return -1;
+		}
+		b += n;
+		len -= n;
+	}
+	return 0;
+}
+
+void screenUpdate(const char *frame, int len) {
+	if (screen.busy) {
+		/* Redrawn from a signal handler mid-frame: try again later */
+		screen.valid = 0;
+		return;
+	}
+	screen.busy = 1;
+
+	if (screen.rows != E.screenrows || screen.cols != E.screencols) {
+		size_t cells = (size_t)E.screenrows * E.screencols;
+		screen.shown =
+			xrealloc(screen.shown, cells * sizeof(*screen.shown));
+		screen.next =
+			xrealloc(screen.next, cells * sizeof(*screen.next));
+		screen.hash = xrealloc(screen.hash, 2 * E.screenrows *
+							    sizeof(*screen.hash));
+		screen.cost = xrealloc(screen.cost, 2 * (E.screenrows + 1) *
+							    sizeof(*screen.cost));
+		screen.rows = E.screenrows;
+		screen.cols = E.screencols;
+		screen.valid = 0;
+	}
+
+	int cy, cx;
+	playFrame(frame, len, &cy, &cx);
+
+	struct abuf *ab = &screen.out;
+	abReset(ab);
+#ifdef EMSYS_SYNC_UPDATE
+	abAppend(ab, CSI "?2026h", 8);
+#endif
+	abAppend(ab, CSI "?25l", 6);
+	if (!screen.valid) {
+		abAppend(ab, CSI "0m" CSI "H" CSI "2J", 11);
+		clearCells(screen.shown, screen.rows * screen.cols);
+		screen.valid = 1;
+	} else {
+		shiftRows(ab);
+	}
+
+	/* Where the terminal's cursor is isn't known at the start, since
+	 * prompts move it about between frames */
+	int cury = -1;
+	int curx = -1;
+	uint8_t attr = 0;
+	for (int y = 0; y < screen.rows; y++)
+		diffRow(ab, y, &cury, &curx, &attr);
+	if (attr != 0)
+		abAppend(ab, CSI "0m", 4);
+	emitMove(ab, cury, curx, cy, cx);
+	abAppend(ab, CSI "?25h", 6);
+#ifdef EMSYS_SYNC_UPDATE
+	abAppend(ab, CSI "?2026l", 8);
+#endif
+
+	double start = emsys_monotonic_seconds();
+	if (writeFrame(ab->b, ab->len) < 0)
+		screen.valid = 0;
+	screen.last_secs = emsys_monotonic_seconds() - start;
+	screen.last_bytes = ab->len;
+	screen.frames++;
+	screen.bytes += ab->len;
+	screen.secs += screen.last_secs;
+
+	struct screenCell *swap = screen.shown;
+	screen.shown = screen.next;
+	screen.next = swap;
+	screen.busy = 0;
+}
+
+void editorRedisplayStats(struct editorConfig *UNUSED(ed),
+			  struct editorBuffer *UNUSED(buf)) {
+	if (screen.frames == 0) {
+		editorSetStatusMessage("No frames written yet");
+		return;
+	}
+	editorSetStatusMessage(
+		"%lu frames, %llu bytes, %.2f ms writing; "
+		"last %d bytes in %.3f ms",
+		screen.frames, screen.bytes, screen.secs * 1e3,
+		screen.last_bytes, screen.last_secs * 1e3);
+}
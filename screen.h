@@ -0,0 +1,15 @@
+#ifndef SCREEN_H
+#define SCREEN_H
+
+struct editorConfig;
+struct editorBuffer;
+
+/* Sends the changes between a drawn frame and what the terminal shows */
+void screenUpdate(const char *frame, int len);
+/* Forgets what the terminal shows, so the next frame repaints it all */
+void screenInvalidate(void);
+/* Shows how many frames and bytes have been written, and how long the
+ * writes took */
+void editorRedisplayStats(struct editorConfig *ed, struct editorBuffer *buf);
+
+#endif /* SCREEN_H */
@@ -11,6 +11,7 @@
 #endif
 #include <sys/ioctl.h>
 #include <unistd.h>
+#include <poll.h>
 #include <string.h>
 #include "unicode.h"
 #include "keymap.h"
@@ -106,6 +107,14 @@ void editorDeserializeUnicode(void) {
 	}
 }
 
+/* Whether a key is waiting, so background work can yield to it */
+int editorInputPending(void) {
+	if (E.playback)
+		return 1;
+	struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+	return poll(&pfd, 1, 0) > 0;
+}
+
 /* Raw reading a keypress - terminal layer only handles raw byte reading and escape sequences */
 int editorReadKey(void) {
 	if (E.playback) {
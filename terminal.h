@@ -6,6 +6,7 @@ void disableRawMode(void);
 void enableRawMode(void);
 int getCursorPosition(int *rows, int *cols);
 int getWindowSize(int *rows, int *cols);
+int editorInputPending(void);
 int editorReadKey(void);
 void editorDeserializeUnicode(void);
 
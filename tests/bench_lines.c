@@ -0,0 +1,83 @@
+/* Line indexing benchmark: emsys_getline loop vs emsys_index_lines */
+#include "../util.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BENCH_SIZE (256u << 20)
+#define BENCH_ROUNDS 3
+
+/* Source-like text: line lengths spread over 0..119 bytes */
+static uint8_t *makeText(size_t len) {
+	uint8_t *text = malloc(len);
+	if (text == NULL)
+		abort();
+	uint32_t seed = 12345;
+	size_t i = 0;
+	while (i < len) {
+		seed = seed * 1103515245 + 12345;
+		size_t linelen = (seed >> 16) % 120;
+		for (size_t j = 0; j < linelen && i < len; j++, i++)
+			text[i] = 'a' + (i % 26);
+		if (i < len)
+			text[i++] = '\n';
+	}
+	return text;
+}
+
+static size_t getlineLines(FILE *fp) {
+	char *line = NULL;
+	size_t linecap = 0;
+	ssize_t linelen;
+	size_t lines = 0;
+	rewind(fp);
+	while ((linelen = emsys_getline(&line, &linecap, fp)) != -1) {
+		while (linelen > 0 && (line[linelen - 1] == '\n' ||
+				       line[linelen - 1] == '\r'))
+			linelen--;
+		lines++;
+	}
+	free(line);
+	return lines;
+}
+
+int main(void) {
+	uint8_t *text = makeText(BENCH_SIZE);
+	FILE *fp = tmpfile();
+	if (fp == NULL || fwrite(text, 1, BENCH_SIZE, fp) != BENCH_SIZE) {
+		perror("tmpfile");
+		return 1;
+	}
+
+	double best_getline = 1e9, best_index = 1e9;
+	size_t lines_getline = 0, lines_index = 0;
+	for (int round = 0; round < BENCH_ROUNDS; round++) {
+		double t0 = emsys_monotonic_seconds();
+		lines_getline = getlineLines(fp);
+		double t1 = emsys_monotonic_seconds();
+		size_t *eol;
+		lines_index = emsys_index_lines(text, BENCH_SIZE, &eol);
+		double t2 = emsys_monotonic_seconds();
+		free(eol);
+		if (t1 - t0 < best_getline)
+			best_getline = t1 - t0;
+		if (t2 - t1 < best_index)
+			best_index = t2 - t1;
+	}
+
+	double mb = BENCH_SIZE / (1024.0 * 1024.0);
+	printf("%.0f MB, %zu lines\n", mb, lines_index);
+	printf("emsys_getline:     %8.1f MB/s\n", mb / best_getline);
+	printf("emsys_index_lines: %8.1f MB/s (%.1fx)\n", mb / best_index,
+	       best_getline / best_index);
+
+	fclose(fp);
+	free(text);
+	if (lines_getline != lines_index) {
+		printf("FAIL: line counts differ (%zu vs %zu)\n", lines_getline,
+		       lines_index);
+		return 1;
+	}
+	return 0;
+}
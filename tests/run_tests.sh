@@ -51,6 +51,21 @@ else
 fi
 rm -f test_core
 
+# Test 5: Undo checkpoints, with the rest of the editor stubbed out
+if nm unicode.o 2>/dev/null | grep -q "__asan_"; then
+    cc -std=c99 -fsanitize=address,undefined -o test_undo tests/test_undo.c undo.o unicode.o wcwidth.o util.o || exit 1
+else
+    cc -std=c99 -o test_undo tests/test_undo.c undo.o unicode.o wcwidth.o util.o || exit 1
+fi
+if ./test_undo | grep -q "FAIL"; then
+    echo "✗ Undo checkpoint tests failed"
+    ./test_undo
+    exit 1
+else
+    echo "✓ Undo checkpoints"
+fi
+rm -f test_undo
+
 
 echo ""
 echo "All tests passed"
\ No newline at end of file
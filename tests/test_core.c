@@ -323,6 +323,75 @@ void test_emsys_getline_multiple_reallocs() {
     fclose(fp);
 }
 
+static void check_line_ends(const char *text, size_t expected_lines) {
+    size_t len = strlen(text);
+    size_t *eol = NULL;
+    size_t n = emsys_index_lines((const uint8_t *)text, len, &eol);
+    TEST_ASSERT_EQUAL_INT((int)expected_lines, (int)n);
+    /* Every entry must be a newline or the end of an unterminated line */
+    for (size_t i = 0; i < n; i++) {
+        TEST_ASSERT(eol[i] <= len);
+        TEST_ASSERT(eol[i] == len || text[eol[i]] == '\n');
+        if (i > 0)
+            TEST_ASSERT(eol[i] > eol[i - 1]);
+    }
+    free(eol);
+}
+
+void test_index_lines_basic() {
+    check_line_ends("", 0);
+    check_line_ends("\n", 1);
+    check_line_ends("abc", 1);
+    check_line_ends("abc\n", 1);
+    check_line_ends("abc\ndef", 2);
+    check_line_ends("a\r\nb\r\n", 2);
+    check_line_ends("\n\n\n", 3);
+}
+
+void test_index_lines_block_boundaries() {
+    /* Put a newline at every offset around the vector widths */
+    char buf[200];
+    for (size_t pos = 0; pos < 100; pos++) {
+        memset(buf, 'x', 100);
+        buf[100] = 0;
+        buf[pos] = '\n';
+        size_t *eol = NULL;
+        size_t n = emsys_index_lines((const uint8_t *)buf, 100, &eol);
+        if (pos == 99) {
+            TEST_ASSERT_EQUAL_INT(1, (int)n);
+        } else {
+            TEST_ASSERT_EQUAL_INT(2, (int)n);
+            TEST_ASSERT_EQUAL_INT(100, (int)eol[1]);
+        }
+        TEST_ASSERT_EQUAL_INT((int)pos, (int)eol[0]);
+        free(eol);
+    }
+    /* Dense newlines force the offset table to grow */
+    char *dense = malloc(5001);
+    memset(dense, '\n', 5000);
+    dense[5000] = 0;
+    check_line_ends(dense, 5000);
+    free(dense);
+}
+
+void test_printable_run() {
+    /* A stop byte at every offset around the word width */
+    const uint8_t stops[] = { '\t', 0x01, 0x1f, 0x7f, 0x80, 0xc3, 0xff };
+    uint8_t buf[40];
+    for (size_t s = 0; s < sizeof(stops); s++) {
+        for (size_t pos = 0; pos < 24; pos++) {
+            memset(buf, 'a', sizeof(buf));
+            buf[pos] = stops[s];
+            TEST_ASSERT_EQUAL_INT((int)pos,
+                                  (int)emsys_printable_run(buf, sizeof(buf)));
+        }
+    }
+    memset(buf, '~', sizeof(buf));
+    buf[0] = ' ';
+    TEST_ASSERT_EQUAL_INT(40, (int)emsys_printable_run(buf, sizeof(buf)));
+    TEST_ASSERT_EQUAL_INT(13, (int)emsys_printable_run(buf, 13));
+}
+
 /* Dummy functions for Unity compatibility */
 void setUp(void) {}
 void tearDown(void) {}
@@ -357,5 +426,10 @@ int main() {
     RUN_TEST(test_emsys_getline_empty_file);
     RUN_TEST(test_emsys_getline_multiple_reallocs);
     
+    /* Line indexing tests */
+    RUN_TEST(test_index_lines_basic);
+    RUN_TEST(test_index_lines_block_boundaries);
+    RUN_TEST(test_printable_run);
+    
     return TEST_END();
 }
\ No newline at end of file
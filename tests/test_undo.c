@@ -0,0 +1,135 @@
+/* Undo checkpoint tests for emsys - stubs stand in for the editor */
+#include "test.h"
+#include "../emsys.h"
+#include "../undo.h"
+#include "../util.h"
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+/* Times undo.c asked for a copy of the text */
+static int copies;
+
+ssize_t editorWriteRows(int fd, struct editorBuffer *bufr) {
+    (void)fd;
+    size_t bytes = 0;
+    for (int i = 0; i < bufr->numrows; i++)
+        bytes += bufr->row[i].size + 1;
+    copies++;
+    return bytes;
+}
+
+void bufferInsertText(struct editorBuffer *bufr, int x, int y,
+                      const uint8_t *text, size_t len) {
+    (void)bufr; (void)x; (void)y; (void)text; (void)len;
+}
+
+void bufferDeleteText(struct editorBuffer *bufr, int startx, int starty,
+                      int endx, int endy) {
+    (void)bufr; (void)startx; (void)starty; (void)endx; (void)endy;
+}
+
+void editorDelRows(struct editorBuffer *bufr, int at, int count) {
+    (void)bufr; (void)at; (void)count;
+}
+
+uint8_t *editorPrompt(struct editorBuffer *bufr, uint8_t *prompt,
+                      enum promptType t,
+                      void (*callback)(struct editorBuffer *, uint8_t *, int)) {
+    (void)bufr; (void)prompt; (void)t; (void)callback;
+    return NULL;
+}
+
+void editorSetStatusMessage(const char *fmt, ...) {
+    (void)fmt;
+}
+
+void die(const char *s) {
+    printf("die: %s\n", s);
+    abort();
+}
+
+/* A buffer of rows rows, each size bytes long, with empty history */
+static struct editorBuffer *makeBuffer(int rows, int size) {
+    struct editorBuffer *buf = xcalloc(1, sizeof(*buf));
+    buf->row = xcalloc(rows, sizeof(erow));
+    for (int i = 0; i < rows; i++) {
+        buf->row[i].chars = xcalloc(size + 1, 1);
+        buf->row[i].size = size;
+    }
+    buf->numrows = rows;
+    buf->undo_group_seq = -1;
+    buf->undo_budget = EMSYS_UNDO_BUDGET;
+    buf->undo_journal.fd = -1;
+    buf->undo_checkpoints.fd = -1;
+    buf->undo_checkpoints.gap = EMSYS_UNDO_CHECKPOINT;
+    buf->undo = newUndo(buf);
+    return buf;
+}
+
+static void freeBuffer(struct editorBuffer *buf) {
+    clearUndosAndRedos(buf);
+    freeUndoPool(buf);
+    for (int i = 0; i < buf->numrows; i++)
+        free(buf->row[i].chars);
+    free(buf->row);
+    free(buf);
+}
+
+/* Records an insertion of len bytes, as a yank would */
+static void recordInsert(struct editorBuffer *buf, int len) {
+    struct editorUndo *new = newUndo(buf);
+    undoReserve(new, len + 1);
+    memset(new->data, 'y', len);
+    new->data[len] = 0;
+    new->datalen = len;
+    new->append = 0;
+    new->prev = buf->undo;
+    buf->undo = new;
+}
+
+/* Copies taken over commands yanks into a buffer of rows by size */
+static int copiesAfter(int rows, int size, int yank, int commands) {
+    struct editorBuffer *buf = makeBuffer(rows, size);
+    copies = 0;
+    for (int i = 0; i < commands; i++) {
+        recordInsert(buf, yank);
+        /* The next command seals the yank, as typing on would */
+        recordInsert(buf, 1);
+        editorUndoCheckpoint(buf);
+    }
+    freeBuffer(buf);
+    return copies;
+}
+
+void test_checkpoint_small_buffer() {
+    /* More history than the minimum gap: worth a copy of a small text */
+    TEST_ASSERT_EQUAL_INT(1, copiesAfter(10, 10, 400 << 10, 1));
+}
+
+void test_checkpoint_large_buffer_short_history() {
+    /* 4 MB of text is not copied for 400 KB of history */
+    TEST_ASSERT_EQUAL_INT(0, copiesAfter(64, 64 << 10, 400 << 10, 1));
+    TEST_ASSERT_EQUAL_INT(0, copiesAfter(64, 64 << 10, 400 << 10, 8));
+}
+
+void test_checkpoint_large_buffer_long_history() {
+    /* Once the history outweighs the text it is copied, and only once */
+    TEST_ASSERT_EQUAL_INT(1, copiesAfter(64, 64 << 10, 400 << 10, 12));
+}
+
+/* Dummy functions for Unity compatibility */
+void setUp(void) {}
+void tearDown(void) {}
+
+int main() {
+    TEST_BEGIN();
+
+    RUN_TEST(test_checkpoint_small_buffer);
+    RUN_TEST(test_checkpoint_large_buffer_short_history);
+    RUN_TEST(test_checkpoint_large_buffer_long_history);
+
+    return TEST_END();
+}
@@ -116,25 +116,45 @@ void editorCapitalizeRegion(struct editorConfig *ed, struct editorBuffer *buf) {
 void editorWhitespaceCleanup(struct editorConfig *UNUSED(ed),
 			     struct editorBuffer *buf) {
 	unsigned int trailing = 0;
+	editorUndoBeginGroup(buf);
 	for (int i = 0; i < buf->numrows; i++) {
 		erow *row = &buf->row[i];
-		for (int j = row->size - 1; j >= 0; j--) {
-			if (row->chars[j] == ' ' || row->chars[j] == '\t') {
-				row->size--;
-				trailing++;
-			} else {
-				break;
-			}
-		}
-		row->render_valid = 0;
+		int end = row->size;
+		while (end > 0 && (row->chars[end - 1] == ' ' ||
+				   row->chars[end - 1] == '\t'))
+			end--;
+		if (end == row->size)
+			continue;
+
+		if (trailing == 0)
+			clearRedos(buf);
+		struct editorUndo *new = newUndo(buf);
+		new->startx = end;
+		new->starty = i;
+		new->endx = row->size;
+		new->endy = i;
+		new->datalen = row->size - end;
+		undoReserve(new, new->datalen + 1);
+		for (int j = 0; j < new->datalen; j++)
+			new->data[j] = row->chars[row->size - j - 1];
+		new->data[new->datalen] = 0;
+		new->append = 0;
+		new->delete = 1;
+		new->prev = buf->undo;
+		buf->undo = new;
+
+		trailing += row->size - end;
+		row->size = end;
+		invalidateRow(buf, row);
 	}
+	editorUndoEndGroup(buf);
 
-	if (buf->cx > buf->row[buf->cy].size) {
+	if (buf->cy < buf->numrows && buf->cx > buf->row[buf->cy].size) {
 		buf->cx = buf->row[buf->cy].size;
 	}
 
 	if (trailing > 0) {
-		clearUndosAndRedos(buf);
+		buf->dirty = 1;
 		editorSetStatusMessage("%d trailing characters removed",
 				       trailing);
 	} else {
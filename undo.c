@@ -1,84 +1,454 @@
+#include <errno.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <unistd.h>
 #include "emsys.h"
 #include "region.h"
 #include "buffer.h"
 #include "undo.h"
 #include "unicode.h"
 #include "display.h"
+#include "fileio.h"
+#include "prompt.h"
 #include "unused.h"
 #include "util.h"
 
+/* Memory a record holds, counted against the buffer's undo budget */
+static size_t undoBytes(struct editorUndo *undo) {
+	size_t bytes = sizeof(*undo);
+	if (undo->data - undo->front != undo->inline_data)
+		bytes += undo->front + undo->datasize;
+	return bytes;
+}
+
+
+static void freeUndos(struct editorBuffer *buf, struct editorUndo *first) {
+	struct editorUndo *cur = first;
+
+	while (cur != NULL) {
+		struct editorUndo *prev = cur->prev;
+		if (cur->data - cur->front != cur->inline_data)
+			free(cur->data - cur->front);
+		cur->prev = buf->undo_pool.free;
+		buf->undo_pool.free = cur;
+		cur = prev;
+	}
+}
+
+
+/*
+ * How a spilled record is laid out in the journal: its payload, then
+ * this.  With the header last the journal can be read back from its
+ * end, newest record first.
+ */
+struct editorUndoSpill {
+	int startx;
+	int starty;
+	int endx;
+	int endy;
+	int delete;
+	int paired;
+	int datalen;
+};
+
+static void closeJournal(struct editorUndoJournal *journal) {
+	if (journal->fd >= 0)
+		close(journal->fd);
+	journal->fd = -1;
+	journal->len = 0;
+	journal->records = 0;
+}
+
+/* An unlinked temporary file for history kept out of memory */
+static int openTemp(void) {
+	const char *dir = getenv("TMPDIR");
+	if (dir == NULL || *dir == '\0')
+		dir = "/tmp";
+	size_t size = strlen(dir) + sizeof("/emsys-undo.XXXXXX");
+	char *path = xmalloc(size);
+	snprintf(path, size, "%s/emsys-undo.XXXXXX", dir);
+	int fd = mkstemp(path);
+	if (fd >= 0)
+		unlink(path);
+	free(path);
+	return fd;
+}
+
+static int openJournal(struct editorUndoJournal *journal) {
+	if (journal->fd < 0)
+		journal->fd = openTemp();
+	return journal->fd < 0 ? -1 : 0;
+}
+
+/*
+ * Forgets the checkpoints from seq onwards; the history they were taken
+ * at has been undone and replaced.  Their text is overwritten by the
+ * next checkpoint.
+ */
+static void dropCheckpoints(struct editorBuffer *buf, int seq) {
+	struct editorUndoCheckpoints *cps = &buf->undo_checkpoints;
+	int n = cps->n;
+	while (n > 0 && cps->list[n - 1].seq >= seq)
+		n--;
+	if (n == cps->n)
+		return;
+	cps->n = n;
+	cps->len = n > 0 ? cps->list[n].at : 0;
+	if (n == 0 && cps->fd >= 0) {
+		close(cps->fd);
+		cps->fd = -1;
+	}
+}
+
+/*
+ * Once the records below the newest outgrow the budget, keeps about
+ * half of it in memory and appends the rest to the journal in one
+ * write.  Nothing is spilled while a group is open, since its records
+ * are paired up in memory when it ends.  If the journal cannot
+ * be written the oldest history is dropped instead.
+ */
+static void undoTrim(struct editorBuffer *buf) {
+	if (buf->undo == NULL || buf->undo_bytes <= buf->undo_budget ||
+	    buf->undo_group_depth > 0)
+		return;
+
+	size_t kept = 0;
+	struct editorUndo *last = buf->undo;
+	while (last->prev != NULL &&
+	       kept + undoBytes(last->prev) <= buf->undo_budget / 2) {
+		last = last->prev;
+		kept += undoBytes(last);
+	}
+	struct editorUndo *spill = last->prev;
+	last->prev = NULL;
+	buf->undo_bytes = kept;
+	if (spill == NULL)
+		return;
+
+	size_t size = 0;
+	int n = 0;
+	for (struct editorUndo *cur = spill; cur != NULL; cur = cur->prev) {
+		size += cur->datalen + sizeof(struct editorUndoSpill);
+		n++;
+	}
+	/* Filled from the end, so the oldest record comes first */
+	uint8_t *out = xmalloc(size);
+	size_t pos = size;
+	for (struct editorUndo *cur = spill; cur != NULL; cur = cur->prev) {
+		struct editorUndoSpill rec = { cur->startx, cur->starty,
+					       cur->endx,   cur->endy,
+					       cur->delete, cur->paired,
+					       cur->datalen };
+		pos -= sizeof(rec);
+		memcpy(out + pos, &rec, sizeof(rec));
+		pos -= cur->datalen;
+		memcpy(out + pos, cur->data, cur->datalen);
+	}
+
+	struct editorUndoJournal *journal = &buf->undo_journal;
+	size_t done = 0;
+	if (openJournal(journal) == 0) {
+		while (done < size) {
+			ssize_t wrote = pwrite(journal->fd, out + done,
+					       size - done, journal->len + done);
+			if (wrote < 0 && errno == EINTR)
+				continue;
+			if (wrote <= 0)
+				break;
+			done += wrote;
+		}
+	}
+	if (done == size) {
+		journal->len += size;
+		journal->records += n;
+	} else {
+		editorSetStatusMessage("Undo history truncated: %s",
+				       strerror(errno));
+		closeJournal(journal);
+	}
+	free(out);
+	freeUndos(buf, spill);
+}
+
+static struct editorUndo *allocUndo(struct editorBuffer *buf) {
+	struct editorUndoPool *pool = &buf->undo_pool;
+	struct editorUndo *ret = pool->free;
+	if (ret != NULL) {
+		pool->free = ret->prev;
+	} else {
+		if (pool->chunks == NULL || pool->used == UNDO_CHUNK) {
+			struct editorUndoChunk *chunk = xmalloc(sizeof(*chunk));
+			chunk->next = pool->chunks;
+			pool->chunks = chunk;
+			pool->used = 0;
+		}
+		ret = &pool->chunks->undos[pool->used++];
+	}
+	ret->prev = NULL;
+	ret->paired = 0;
+	ret->startx = 0;
+	ret->starty = 0;
+	ret->endx = 0;
+	ret->endy = 0;
+	ret->append = 1;
+	ret->delete = 0;
+	ret->datalen = 0;
+	ret->datasize = UNDO_INLINE;
+	ret->front = 0;
+	ret->data = ret->inline_data;
+	ret->data[0] = 0;
+	return ret;
+}
+
+struct editorUndo *newUndo(struct editorBuffer *buf) {
+	/* The caller pushes the new record, so the newest one is done */
+	if (buf->undo != NULL) {
+		size_t bytes = undoBytes(buf->undo);
+		buf->undo_bytes += bytes;
+		buf->undo_checkpoints.since += bytes;
+		undoTrim(buf);
+	}
+	dropCheckpoints(buf, ++buf->undo_seq);
+	return allocUndo(buf);
+}
+
+/*
+ * Makes room for size bytes of payload from data onwards, moving it to
+ * the heap once it outgrows the record's inline bytes.
+ */
+void undoReserve(struct editorUndo *undo, size_t size) {
+	if (size <= (size_t)undo->datasize)
+		return;
+	if (size > (size_t)(INT_MAX - undo->front))
+		die("buffer size overflow");
+	uint8_t *base = undo->data - undo->front;
+	if (base == undo->inline_data) {
+		base = xmalloc(undo->front + size);
+		memcpy(base, undo->inline_data, UNDO_INLINE);
+	} else {
+		base = xrealloc(base, undo->front + size);
+	}
+	undo->data = base + undo->front;
+	undo->datasize = size;
+}
+
+/*
+ * Puts n bytes in front of the payload.  Headroom is regrown to twice
+ * what's in use when it runs out, so prepending a byte at a time stays
+ * linear overall.
+ */
+static void undoPrepend(struct editorUndo *undo, const uint8_t *bytes, int n) {
+	if (undo->front < n) {
+		size_t front = ((size_t)undo->datalen + n) * 2;
+		if (front + undo->datasize > INT_MAX)
+			die("buffer size overflow");
+		uint8_t *base = xmalloc(front + undo->datasize);
+		memcpy(base + front, undo->data, undo->datasize);
+		uint8_t *old = undo->data - undo->front;
+		if (old != undo->inline_data)
+			free(old);
+		undo->data = base + front;
+		undo->front = front;
+	}
+	undo->data -= n;
+	undo->front -= n;
+	undo->datasize += n;
+	undo->datalen += n;
+	memcpy(undo->data, bytes, n);
+}
+
+/* Adds c to the end of the payload, doubling its room as it fills */
+static void undoAppend(struct editorUndo *undo, uint8_t c) {
+	/* A kill reserves its payload exactly, so it may have no room */
+	undoReserve(undo, (size_t)undo->datalen + 2);
+	undo->data[undo->datalen++] = c;
+	undo->data[undo->datalen] = 0;
+	if (undo->datalen >= undo->datasize - 2)
+		undoReserve(undo, (size_t)undo->datasize * 2);
+}
+
+
+/*
+ * Reads the newest spilled records back from the journal, about half
+ * the budget's worth, once everything in memory has been undone.
+ */
+static void undoPageIn(struct editorBuffer *buf) {
+	struct editorUndoJournal *journal = &buf->undo_journal;
+	struct editorUndo *newest = NULL;
+	struct editorUndo *oldest = NULL;
+	size_t bytes = 0;
+
+	while (journal->records > 0 && bytes < buf->undo_budget / 2) {
+		struct editorUndoSpill rec;
+		size_t at = journal->len - sizeof(rec);
+		if (journal->len < sizeof(rec) ||
+		    pread(journal->fd, &rec, sizeof(rec), at) != sizeof(rec) ||
+		    rec.datalen < 0 || (size_t)rec.datalen > at)
+			goto lost;
+		at -= rec.datalen;
+
+		struct editorUndo *undo = allocUndo(buf);
+		undo->startx = rec.startx;
+		undo->starty = rec.starty;
+		undo->endx = rec.endx;
+		undo->endy = rec.endy;
+		undo->delete = rec.delete;
+		undo->paired = rec.paired;
+		undo->append = 0;
+		undoReserve(undo, (size_t)rec.datalen + 1);
+		if (pread(journal->fd, undo->data, rec.datalen, at) !=
+		    rec.datalen) {
+			freeUndos(buf, undo);
+			goto lost;
+		}
+		undo->datalen = rec.datalen;
+		undo->data[undo->datalen] = 0;
+		bytes += undoBytes(undo);
+		if (oldest != NULL)
+			oldest->prev = undo;
+		else
+			newest = undo;
+		oldest = undo;
+
+		journal->len = at;
+		journal->records--;
+	}
+	if (journal->records == 0)
+		closeJournal(journal);
+	else if (ftruncate(journal->fd, journal->len) != 0) {
+		/* The space is reused by the next spill anyway */
+	}
+	goto done;
+
+lost:
+	editorSetStatusMessage("Undo history lost: %s",
+			       strerror(errno));
+	closeJournal(journal);
+done:
+	buf->undo = newest;
+	if (newest != NULL)
+		buf->undo_bytes = bytes - undoBytes(newest);
+}
+
+/* The newest undo record, paging history back in when it runs out */
+static struct editorUndo *undoHead(struct editorBuffer *buf) {
+	if (buf->undo == NULL && buf->undo_journal.records > 0)
+		undoPageIn(buf);
+	return buf->undo;
+}
+
+void clearRedos(struct editorBuffer *buf) {
+	freeUndos(buf, buf->redo);
+	buf->redo = NULL;
+	dropCheckpoints(buf, buf->undo_seq + 1);
+}
+
+void clearUndosAndRedos(struct editorBuffer *buf) {
+	freeUndos(buf, buf->undo);
+	buf->undo = NULL;
+	buf->undo_bytes = 0;
+	closeJournal(&buf->undo_journal);
+	clearRedos(buf);
+	buf->undo_seq = 0;
+	buf->undo_group_seq = -1;
+	dropCheckpoints(buf, 0);
+	free(buf->undo_checkpoints.list);
+	buf->undo_checkpoints.list = NULL;
+	buf->undo_checkpoints.cap = 0;
+	buf->undo_checkpoints.since = 0;
+	buf->undo_checkpoints.gap = EMSYS_UNDO_CHECKPOINT;
+
+	/* Nothing is live any more: keep one chunk and start it over */
+	struct editorUndoPool *pool = &buf->undo_pool;
+	if (pool->chunks != NULL) {
+		struct editorUndoChunk *chunk = pool->chunks->next;
+		while (chunk != NULL) {
+			struct editorUndoChunk *next = chunk->next;
+			free(chunk);
+			chunk = next;
+		}
+		pool->chunks->next = NULL;
+	}
+	pool->used = 0;
+	pool->free = NULL;
+}
+
+void freeUndoPool(struct editorBuffer *buf) {
+	struct editorUndoChunk *chunk = buf->undo_pool.chunks;
+	while (chunk != NULL) {
+		struct editorUndoChunk *next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+	memset(&buf->undo_pool, 0, sizeof(buf->undo_pool));
+}
+
+/* Reverts the text change of one undo record */
+static int undoApply(struct editorBuffer *buf, struct editorUndo *undo) {
+	if (undo->delete) {
+		/* Deleted text is kept reversed */
+		int len = undo->datalen;
+		uint8_t *text = xmalloc(len + 1);
+		for (int i = 0; i < len; i++)
+			text[i] = undo->data[len - 1 - i];
+		bufferInsertText(buf, undo->startx, undo->starty, text, len);
+		free(text);
+		buf->cx = undo->endx;
+		buf->cy = undo->endy;
+	} else {
+		if (buf->numrows == 0 || undo->starty >= buf->numrows)
+			return 0;
+		bufferDeleteText(buf, undo->startx, undo->starty, undo->endx,
+				 undo->endy);
+	}
+	return 1;
+}
+
+/* Moves the newest undo record onto the redo list */
+static void undoPop(struct editorBuffer *buf) {
+	struct editorUndo *undo = buf->undo;
+	buf->undo = undo->prev;
+	undo->prev = buf->redo;
+	buf->redo = undo;
+	if (--buf->undo_seq < buf->undo_group_seq)
+		buf->undo_group_seq = -1;
+	if (buf->undo != NULL) {
+		size_t bytes = undoBytes(buf->undo);
+		buf->undo_bytes = bytes < buf->undo_bytes ?
+					  buf->undo_bytes - bytes :
+					  0;
+	}
+}
+
+/* Reverts the newest undo record and moves it onto the redo list */
+static int undoRecord(struct editorBuffer *buf) {
+	if (!undoApply(buf, buf->undo))
+		return 0;
+	undoPop(buf);
+	return 1;
+}
+
+/*
+ * Undoes count changes.  A record marked paired goes together with the
+ * one before it, so a group comes undone in one step; the chain is
+ * walked in a loop however long it is.
+ */
 void editorDoUndo(struct editorBuffer *buf, int count) {
 	int times = count ? count : 1;
 	for (int j = 0; j < times; j++) {
-		if (buf->undo == NULL) {
+		if (undoHead(buf) == NULL) {
 			editorSetStatusMessage("No further undo information.");
 			return;
 		}
-		int paired = buf->undo->paired;
-
-		if (buf->undo->delete) {
-			buf->cx = buf->undo->startx;
-			buf->cy = buf->undo->starty;
-			for (int i = buf->undo->datalen - 1; i >= 0; i--) {
-				if (buf->undo->data[i] == '\n') {
-					editorInsertNewline(buf, 1);
-				} else {
-					editorInsertChar(buf,
-							 buf->undo->data[i], 1);
-				}
-			}
-			buf->cx = buf->undo->endx;
-			buf->cy = buf->undo->endy;
-		} else {
-			if (buf->numrows == 0 ||
-			    buf->undo->starty >= buf->numrows) {
+		int paired;
+		do {
+			paired = buf->undo->paired;
+			if (!undoRecord(buf))
 				return;
-			}
-			struct erow *row = &buf->row[buf->undo->starty];
-			if (buf->undo->starty == buf->undo->endy) {
-				memmove(&row->chars[buf->undo->startx],
-					&row->chars[buf->undo->endx],
-					row->size - buf->undo->endx);
-				row->size -=
-					buf->undo->endx - buf->undo->startx;
-				row->chars[row->size] = 0;
-			} else {
-				for (int i = buf->undo->starty + 1;
-				     i < buf->undo->endy; i++) {
-					editorDelRow(buf,
-						     buf->undo->starty + 1);
-				}
-				if (buf->undo->starty + 1 >= buf->numrows) {
-					return;
-				}
-				struct erow *last =
-					&buf->row[buf->undo->starty + 1];
-				row->size = buf->undo->startx;
-				row->size += last->size - buf->undo->endx;
-				row->chars = xrealloc(row->chars, row->size);
-				memcpy(&row->chars[buf->undo->startx],
-				       &last->chars[buf->undo->endx],
-				       last->size - buf->undo->endx);
-				editorDelRow(buf, buf->undo->starty + 1);
-			}
-			buf->cx = buf->undo->startx;
-			buf->cy = buf->undo->starty;
-		}
-
-		editorUpdateBuffer(buf);
-
-		struct editorUndo *orig = buf->redo;
-		buf->redo = buf->undo;
-		buf->undo = buf->undo->prev;
-		buf->redo->prev = orig;
-
-		if (paired) {
-			editorDoUndo(buf, 1);
-		}
+		} while (paired && undoHead(buf) != NULL);
 	}
 }
 
@@ -98,6 +468,32 @@ void debugUnpair(struct editorConfig *UNUSED(ed), struct editorBuffer *buf) {
 }
 #endif
 
+/* Moves the newest redo record back onto the undo list */
+static void undoPush(struct editorBuffer *buf) {
+	struct editorUndo *redo = buf->redo;
+	if (buf->undo != NULL)
+		buf->undo_bytes += undoBytes(buf->undo);
+	buf->redo = redo->prev;
+	redo->prev = buf->undo;
+	buf->undo = redo;
+	buf->undo_seq++;
+}
+
+/* Reapplies the newest redo record and moves it back onto the undo list */
+static void redoRecord(struct editorBuffer *buf) {
+	struct editorUndo *redo = buf->redo;
+	if (redo->delete) {
+		bufferDeleteText(buf, redo->startx, redo->starty, redo->endx,
+				 redo->endy);
+	} else {
+		bufferInsertText(buf, redo->startx, redo->starty, redo->data,
+				 redo->datalen);
+		buf->cx = redo->endx;
+		buf->cy = redo->endy;
+	}
+	undoPush(buf);
+}
+
 void editorDoRedo(struct editorBuffer *buf, int count) {
 	int times = count ? count : 1;
 	for (int j = 0; j < times; j++) {
@@ -105,100 +501,209 @@ void editorDoRedo(struct editorBuffer *buf, int count) {
 			editorSetStatusMessage("No further redo information.");
 			return;
 		}
+		do {
+			redoRecord(buf);
+		} while (buf->redo != NULL && buf->redo->paired);
+	}
+}
 
-		if (buf->redo->delete) {
-			struct erow *row = &buf->row[buf->redo->starty];
-			if (buf->redo->starty == buf->redo->endy) {
-				memmove(&row->chars[buf->redo->startx],
-					&row->chars[buf->redo->endx],
-					row->size - buf->redo->endx);
-				row->size -=
-					buf->redo->endx - buf->redo->startx;
-				row->chars[row->size] = 0;
-			} else {
-				for (int i = buf->redo->starty + 1;
-				     i < buf->redo->endy; i++) {
-					editorDelRow(buf,
-						     buf->redo->starty + 1);
-				}
-				struct erow *last =
-					&buf->row[buf->redo->starty + 1];
-				row->size = buf->redo->startx;
-				row->size += last->size - buf->redo->endx;
-				row->chars = xrealloc(row->chars, row->size);
-				memcpy(&row->chars[buf->redo->startx],
-				       &last->chars[buf->redo->endx],
-				       last->size - buf->redo->endx);
-				editorDelRow(buf, buf->redo->starty + 1);
-			}
-			buf->cx = buf->redo->startx;
-			buf->cy = buf->redo->starty;
-		} else {
-			buf->cx = buf->redo->startx;
-			buf->cy = buf->redo->starty;
-			for (int i = 0; i < buf->redo->datalen; i++) {
-				if (buf->redo->data[i] == '\n') {
-					editorInsertNewline(buf, 1);
-				} else {
-					editorInsertChar(buf,
-							 buf->redo->data[i], 1);
-				}
-			}
-			buf->cx = buf->redo->endx;
-			buf->cy = buf->redo->endy;
-		}
+/* Bytes the text takes written out, a newline after every row */
+static size_t textBytes(struct editorBuffer *buf) {
+	size_t bytes = 0;
+	for (int i = 0; i < buf->numrows; i++)
+		bytes += buf->row[i].size + 1;
+	return bytes;
+}
 
-		editorUpdateBuffer(buf);
+/*
+ * Saves a copy of the text once enough history has been recorded since
+ * the last one.  Called between commands, when the text is just what
+ * the newest record left.  Copies are spaced at least as far apart as
+ * the text is long, so writing them costs no more than the history.
+ */
+void editorUndoCheckpoint(struct editorBuffer *buf) {
+	struct editorUndoCheckpoints *cps = &buf->undo_checkpoints;
+	if (buf->undo == NULL || buf->load != NULL ||
+	    buf->undo_group_depth > 0 || cps->since < cps->gap)
+		return;
+	/* The gap only knows the text as last copied, or not at all */
+	size_t bytes = textBytes(buf);
+	if (cps->since < bytes) {
+		cps->gap = bytes;
+		return;
+	}
+	cps->since = 0;
 
-		struct editorUndo *orig = buf->undo;
-		buf->undo = buf->redo;
-		buf->redo = buf->redo->prev;
-		buf->undo->prev = orig;
+	if (cps->fd < 0 && (cps->fd = openTemp()) < 0)
+		goto fail;
+	if (lseek(cps->fd, cps->len, SEEK_SET) < 0)
+		goto fail;
+	ssize_t len = editorWriteRows(cps->fd, buf);
+	if (len < 0)
+		goto fail;
 
-		if (buf->redo != NULL && buf->redo->paired) {
-			editorDoRedo(buf, 1);
-		}
+	if (cps->n == cps->cap) {
+		cps->cap = cps->cap ? cps->cap * 2 : 16;
+		cps->list = xrealloc(cps->list, cps->cap * sizeof(*cps->list));
 	}
+	struct editorUndoCheckpoint *cp = &cps->list[cps->n++];
+	cp->seq = buf->undo_seq;
+	cp->numrows = buf->numrows;
+	cp->cx = buf->cx;
+	cp->cy = buf->cy;
+	cp->at = cps->len;
+	cp->len = len;
+	cps->len += len;
+	cps->gap = (size_t)len > EMSYS_UNDO_CHECKPOINT ? (size_t)len :
+							 EMSYS_UNDO_CHECKPOINT;
+	/* Typing on must not grow the record the copy was taken at */
+	buf->undo->append = 0;
+	return;
+
+fail:
+	editorSetStatusMessage("Undo checkpoint failed: %s", strerror(errno));
 }
 
-struct editorUndo *newUndo(void) {
-	struct editorUndo *ret = xmalloc(sizeof(*ret));
-	ret->prev = NULL;
-	ret->paired = 0;
-	ret->startx = 0;
-	ret->starty = 0;
-	ret->endx = 0;
-	ret->endy = 0;
-	ret->append = 1;
-	ret->delete = 0;
-	ret->datalen = 0;
-	ret->datasize = 22;
-	ret->data = xmalloc(ret->datasize);
-	ret->data[0] = 0;
-	return ret;
+/* Replaces the text with a checkpoint's copy of it */
+static int restoreCheckpoint(struct editorBuffer *buf,
+			     struct editorUndoCheckpoint *cp) {
+	uint8_t *text = xmalloc(cp->len + 1);
+	size_t done = 0;
+	while (done < cp->len) {
+		ssize_t got = pread(buf->undo_checkpoints.fd, text + done,
+				    cp->len - done, cp->at + done);
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got <= 0) {
+			if (got == 0)
+				errno = EIO;
+			editorSetStatusMessage("Undo checkpoint lost: %s",
+					       strerror(errno));
+			free(text);
+			return 0;
+		}
+		done += got;
+	}
+
+	editorDelRows(buf, 0, buf->numrows);
+	/* Every row was written with a newline after it */
+	if (cp->numrows > 0)
+		bufferInsertText(buf, 0, 0, text, cp->len - 1);
+	free(text);
+	buf->cx = cp->cx;
+	buf->cy = cp->cy;
+	buf->dirty = 1;
+	return 1;
 }
 
-static void freeUndos(struct editorUndo *first) {
-	struct editorUndo *cur = first;
-	struct editorUndo *prev;
+/*
+ * Undoes steps changes at once.  The records are first moved onto the
+ * redo list without touching the text.  Then the text is either taken
+ * back through each of them, or restored from the nearest checkpoint
+ * at or after the target and taken back through the few below that,
+ * whichever has less to copy.
+ */
+static void undoJump(struct editorBuffer *buf, int steps) {
+	struct editorUndo **undone = NULL;
+	int n = 0;
+	int cap = 0;
+	int from = buf->undo_seq;
+	int j;
 
-	while (cur != NULL) {
-		free(cur->data);
-		prev = cur;
-		cur = prev->prev;
-		free(prev);
+	for (j = 0; j < steps && undoHead(buf) != NULL; j++) {
+		int paired;
+		do {
+			if (n == cap) {
+				cap = cap ? cap * 2 : 64;
+				undone = xrealloc(undone,
+						  cap * sizeof(*undone));
+			}
+			undone[n++] = buf->undo;
+			paired = buf->undo->paired;
+			undoPop(buf);
+		} while (paired && undoHead(buf) != NULL);
 	}
+
+	struct editorUndoCheckpoints *cps = &buf->undo_checkpoints;
+	int first = 0;
+	for (int i = 0; i < cps->n; i++) {
+		struct editorUndoCheckpoint *cp = &cps->list[i];
+		if (cp->seq < buf->undo_seq)
+			continue;
+		if (cp->seq >= from)
+			break;
+		size_t skipped = 0;
+		for (int k = 0; k < from - cp->seq; k++)
+			skipped += undone[k]->datalen +
+				   sizeof(struct editorUndo);
+		if (cp->len < skipped && restoreCheckpoint(buf, cp))
+			first = from - cp->seq;
+		break;
+	}
+	for (int i = first; i < n; i++) {
+		if (!undoApply(buf, undone[i])) {
+			/* The history stops at the last record taken back */
+			for (int k = i; k < n; k++)
+				undoPush(buf);
+			editorSetStatusMessage(
+				"Undo stopped after %d of %d changes", i, n);
+			free(undone);
+			return;
+		}
+	}
+	free(undone);
+
+	if (j < steps)
+		editorSetStatusMessage("No further undo information.");
 }
 
-void clearRedos(struct editorBuffer *buf) {
-	freeUndos(buf->redo);
-	buf->redo = NULL;
+void editorUndoJump(struct editorConfig *UNUSED(ed), struct editorBuffer *buf) {
+	uint8_t *stepS =
+		editorPrompt(buf, "Undo how many changes: %s", PROMPT_BASIC, NULL);
+	if (stepS == NULL) {
+		goto cancel;
+	}
+	int steps = atoi((char *)stepS);
+	free(stepS);
+	if (steps <= 0) {
+cancel:
+		editorSetStatusMessage("Canceled.");
+		return;
+	}
+	undoJump(buf, steps);
 }
 
-void clearUndosAndRedos(struct editorBuffer *buf) {
-	freeUndos(buf->undo);
-	buf->undo = NULL;
-	clearRedos(buf);
+/*
+ * Brackets a command so that all the records it makes are undone and
+ * redone as one.  Groups nest; only the outermost one counts.  The
+ * newest record is closed off at both ends so typing before or after
+ * the group is not merged into it.
+ */
+void editorUndoBeginGroup(struct editorBuffer *buf) {
+	if (buf->undo_group_depth++ > 0)
+		return;
+	if (buf->undo != NULL)
+		buf->undo->append = 0;
+	buf->undo_group_seq = buf->undo_seq;
+}
+
+void editorUndoEndGroup(struct editorBuffer *buf) {
+	if (buf->undo_group_depth == 0 || --buf->undo_group_depth > 0)
+		return;
+
+	/* Pair only if the group's start is still below the newest record;
+	 * an undo in the middle of the group may have taken it away. */
+	if (buf->undo_group_seq < 0)
+		return;
+	int n = buf->undo_seq - buf->undo_group_seq;
+	struct editorUndo *cur = buf->undo;
+	for (int i = 0; i < n - 1 && cur != NULL; i++) {
+		cur->paired = 1;
+		cur = cur->prev;
+	}
+	if (buf->undo != NULL)
+		buf->undo->append = 0;
+	undoTrim(buf);
 }
 
 #define ALIGNED(x1, y1, x2, y2) ((x1 == x2) && (y1 == y2))
@@ -209,7 +714,7 @@ void editorUndoAppendChar(struct editorBuffer *buf, uint8_t c) {
 	    !ALIGNED(buf->undo->endx, buf->undo->endy, buf->cx, buf->cy)) {
 		if (buf->undo != NULL)
 			buf->undo->append = 0;
-		struct editorUndo *new = newUndo();
+		struct editorUndo *new = newUndo(buf);
 		new->prev = buf->undo;
 		new->startx = buf->cx;
 		new->starty = buf->cy;
@@ -217,16 +722,7 @@ void editorUndoAppendChar(struct editorBuffer *buf, uint8_t c) {
 		new->endy = buf->cy;
 		buf->undo = new;
 	}
-	buf->undo->data[buf->undo->datalen++] = c;
-	buf->undo->data[buf->undo->datalen] = 0;
-	if (buf->undo->datalen >= buf->undo->datasize - 2) {
-		if ((size_t)buf->undo->datasize > SIZE_MAX / 2) {
-			die("buffer size overflow");
-		}
-		buf->undo->datasize *= 2;
-		buf->undo->data =
-			xrealloc(buf->undo->data, buf->undo->datasize);
-	}
+	undoAppend(buf->undo, c);
 	buf->undo->append = !(buf->undo->datalen >= buf->undo->datasize - 2);
 	if (c == '\n') {
 		buf->undo->endx = 0;
@@ -245,7 +741,7 @@ void editorUndoAppendUnicode(struct editorConfig *ed,
 	    !ALIGNED(buf->undo->endx, buf->undo->endy, buf->cx, buf->cy)) {
 		if (buf->undo != NULL)
 			buf->undo->append = 0;
-		struct editorUndo *new = newUndo();
+		struct editorUndo *new = newUndo(buf);
 		new->prev = buf->undo;
 		new->startx = buf->cx;
 		new->starty = buf->cy;
@@ -270,7 +766,7 @@ void editorUndoBackSpace(struct editorBuffer *buf, uint8_t c) {
 	       buf->cy == buf->undo->starty))) {
 		if (buf->undo != NULL)
 			buf->undo->append = 0;
-		struct editorUndo *new = newUndo();
+		struct editorUndo *new = newUndo(buf);
 		new->prev = buf->undo;
 		new->endx = buf->cx;
 		if (c != '\n')
@@ -281,16 +777,7 @@ void editorUndoBackSpace(struct editorBuffer *buf, uint8_t c) {
 		new->delete = 1;
 		buf->undo = new;
 	}
-	buf->undo->data[buf->undo->datalen++] = c;
-	buf->undo->data[buf->undo->datalen] = 0;
-	if (buf->undo->datalen >= buf->undo->datasize - 2) {
-		if ((size_t)buf->undo->datasize > SIZE_MAX / 2) {
-			die("buffer size overflow");
-		}
-		buf->undo->datasize *= 2;
-		buf->undo->data =
-			xrealloc(buf->undo->data, buf->undo->datasize);
-	}
+	undoAppend(buf->undo, c);
 	if (c == '\n') {
 		buf->undo->starty--;
 		buf->undo->startx = buf->row[buf->undo->starty].size;
@@ -305,7 +792,7 @@ void editorUndoDelChar(struct editorBuffer *buf, erow *row) {
 	    !(buf->undo->startx == buf->cx && buf->undo->starty == buf->cy)) {
 		if (buf->undo != NULL)
 			buf->undo->append = 0;
-		struct editorUndo *new = newUndo();
+		struct editorUndo *new = newUndo(buf);
 		new->prev = buf->undo;
 		new->endx = buf->cx;
 		new->endy = buf->cy;
@@ -315,37 +802,18 @@ void editorUndoDelChar(struct editorBuffer *buf, erow *row) {
 		buf->undo = new;
 	}
 
+	/* The payload is kept reversed, so bytes deleted forward go in
+	 * front of it. */
 	if (buf->cx == row->size) {
-		buf->undo->datalen++;
-		if (buf->undo->datalen >= buf->undo->datasize - 2) {
-			if ((size_t)buf->undo->datasize > SIZE_MAX / 2) {
-				die("buffer size overflow");
-			}
-			buf->undo->datasize *= 2;
-			buf->undo->data =
-				xrealloc(buf->undo->data, buf->undo->datasize);
-		}
-		memmove(&buf->undo->data[1], buf->undo->data,
-			buf->undo->datalen - 1);
-		buf->undo->data[0] = '\n';
+		undoPrepend(buf->undo, (uint8_t *)"\n", 1);
 		buf->undo->endy++;
 		buf->undo->endx = 0;
 	} else {
+		uint8_t bytes[4];
 		int n = utf8_nBytes(row->chars[buf->cx]);
-		buf->undo->datalen += n;
-		if (buf->undo->datalen >= buf->undo->datasize - 2) {
-			if ((size_t)buf->undo->datasize > SIZE_MAX / 2) {
-				die("buffer size overflow");
-			}
-			buf->undo->datasize *= 2;
-			buf->undo->data =
-				xrealloc(buf->undo->data, buf->undo->datasize);
-		}
-		memmove(&buf->undo->data[n], buf->undo->data,
-			buf->undo->datalen - n);
-		for (int i = 0; i < n; i++) {
-			buf->undo->data[i] = row->chars[buf->cx + n - i - 1];
-			buf->undo->endx++;
-		}
+		for (int i = 0; i < n; i++)
+			bytes[i] = row->chars[buf->cx + n - i - 1];
+		undoPrepend(buf->undo, bytes, n);
+		buf->undo->endx += n;
 	}
 }
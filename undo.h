@@ -5,11 +5,17 @@
 
 void editorDoUndo(struct editorBuffer *buf, int count);
 void editorDoRedo(struct editorBuffer *buf, int count);
+void editorUndoCheckpoint(struct editorBuffer *buf);
+void editorUndoJump(struct editorConfig *ed, struct editorBuffer *buf);
+void editorUndoBeginGroup(struct editorBuffer *buf);
+void editorUndoEndGroup(struct editorBuffer *buf);
 void editorUndoAppendChar(struct editorBuffer *buf, uint8_t c);
 void editorUndoAppendUnicode(struct editorConfig *ed, struct editorBuffer *buf);
 void editorUndoBackSpace(struct editorBuffer *buf, uint8_t c);
 void editorUndoDelChar(struct editorBuffer *buf, erow *row);
-struct editorUndo *newUndo(void);
+struct editorUndo *newUndo(struct editorBuffer *buf);
+void undoReserve(struct editorUndo *undo, size_t size);
+void freeUndoPool(struct editorBuffer *buf);
 void clearRedos(struct editorBuffer *buf);
 void clearUndosAndRedos(struct editorBuffer *buf);
 #ifdef EMSYS_DEBUG_UNDO
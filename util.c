@@ -1,9 +1,15 @@
 #include "util.h"
 #include <errno.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <pwd.h>
 #include <sys/types.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 void *xmalloc(size_t size) {
 	void *ptr = malloc(size);
@@ -98,6 +104,12 @@ ssize_t emsys_getline(char **lineptr, size_t *n, FILE *stream) {
 	return (*lineptr)[0] != '\0' ? (ssize_t)strlen(*lineptr) : -1;
 }
 
+double emsys_monotonic_seconds(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
 size_t emsys_strlcpy(char *dst, const char *src, size_t dsize) {
 	const char *osrc = src;
 	size_t nleft = dsize;
@@ -147,3 +159,115 @@ size_t emsys_strlcat(char *dst, const char *src, size_t dsize) {
 
 	return (dlen + (src - osrc)); /* count does not include NUL */
 }
+
+static void reserveLineEnds(size_t **eolp, size_t *cap, size_t need) {
+	if (need <= *cap)
+		return;
+	while (*cap < need) {
+		if (*cap > SIZE_MAX / 2 / sizeof(size_t))
+			abort();
+		*cap *= 2;
+	}
+	*eolp = xrealloc(*eolp, *cap * sizeof(size_t));
+}
+
+static void pushLineEnd(size_t **eolp, size_t *cap, size_t *n, size_t off) {
+	reserveLineEnds(eolp, cap, *n + 1);
+	(*eolp)[(*n)++] = off;
+}
+
+#if defined(__AVX2__) || defined(__SSE2__)
+static int lowestBit(uint32_t mask) {
+#if defined(__GNUC__)
+	return __builtin_ctz(mask);
+#else
+	int bit = 0;
+	while (!(mask & 1)) {
+		mask >>= 1;
+		bit++;
+	}
+	return bit;
+#endif
+}
+#endif
+
+size_t emsys_index_lines(const uint8_t *text, size_t len, size_t **eolp) {
+	size_t cap = 1024;
+	size_t n = 0;
+	size_t i = 0;
+	*eolp = xmalloc(cap * sizeof(size_t));
+
+#if defined(__AVX2__)
+	const __m256i nl = _mm256_set1_epi8('\n');
+	for (; i + 32 <= len; i += 32) {
+		__m256i block = _mm256_loadu_si256((const __m256i *)(text + i));
+		uint32_t mask = (uint32_t)_mm256_movemask_epi8(
+			_mm256_cmpeq_epi8(block, nl));
+		if (mask == 0)
+			continue;
+		reserveLineEnds(eolp, &cap, n + 32);
+		size_t *eol = *eolp;
+		do {
+			eol[n++] = i + lowestBit(mask);
+			mask &= mask - 1;
+		} while (mask);
+	}
+#elif defined(__SSE2__)
+	const __m128i nl = _mm_set1_epi8('\n');
+	for (; i + 16 <= len; i += 16) {
+		__m128i block = _mm_loadu_si128((const __m128i *)(text + i));
+		uint32_t mask =
+			(uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(block, nl));
+		if (mask == 0)
+			continue;
+		reserveLineEnds(eolp, &cap, n + 16);
+		size_t *eol = *eolp;
+		do {
+			eol[n++] = i + lowestBit(mask);
+			mask &= mask - 1;
+		} while (mask);
+	}
+#else
+	/* Eight bytes at a time: only words that may hold a newline get
+	 * looked at bytewise. */
+	const uint64_t ones = 0x0101010101010101ULL;
+	const uint64_t highs = 0x8080808080808080ULL;
+	for (; i + 8 <= len; i += 8) {
+		uint64_t word;
+		memcpy(&word, text + i, 8);
+		word ^= ones * '\n';
+		if (((word - ones) & ~word & highs) == 0)
+			continue;
+		for (size_t j = i; j < i + 8; j++) {
+			if (text[j] == '\n')
+				pushLineEnd(eolp, &cap, &n, j);
+		}
+	}
+#endif
+	for (; i < len; i++) {
+		if (text[i] == '\n')
+			pushLineEnd(eolp, &cap, &n, i);
+	}
+
+	/* An unterminated last line ends at the end of the text */
+	if (len > 0 && (n == 0 || (*eolp)[n - 1] != len - 1))
+		pushLineEnd(eolp, &cap, &n, len);
+	return n;
+}
+
+size_t emsys_printable_run(const uint8_t *text, size_t len) {
+	const uint64_t ones = 0x0101010101010101ULL;
+	const uint64_t highs = 0x8080808080808080ULL;
+	size_t i = 0;
+	/* A byte below 0x20 borrows and one at 0x7f or above carries into
+	 * its high bit; either can only flag a word falsely, never miss. */
+	for (; i + 8 <= len; i += 8) {
+		uint64_t word;
+		memcpy(&word, text + i, 8);
+		if (((word - ones * 0x20) | (word + ones) | word) & highs)
+			break;
+	}
+	while (i < len && text[i] >= 0x20 && text[i] < 0x7f)
+		i++;
+	return i;
+}
@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <sys/types.h>
 
 /* Memory allocation wrappers that abort on failure */
@@ -15,6 +16,22 @@ char *xstrdup(const char *s);
 /* Portable getline implementation */
 ssize_t emsys_getline(char **lineptr, size_t *n, FILE *stream);
 
+/*
+ * Finds where each line of text ends: the offset of its newline, or len
+ * for an unterminated last line.  Stores a malloc'd table in *eolp and
+ * returns the number of lines.
+ */
+size_t emsys_index_lines(const uint8_t *text, size_t len, size_t **eolp);
+
+/*
+ * Returns how many bytes at the start of text are printable ASCII,
+ * each one screen column wide.
+ */
+size_t emsys_printable_run(const uint8_t *text, size_t len);
+
+/* Seconds on the monotonic clock, for measuring intervals */
+double emsys_monotonic_seconds(void);
+
 /* Safe string functions (BSD-style but portable) */
 size_t emsys_strlcpy(char *dst, const char *src, size_t dsize);
 size_t emsys_strlcat(char *dst, const char *src, size_t dsize);